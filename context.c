@@ -0,0 +1,201 @@
+/*
+ * JTuner - context.c
+ * Copyright 2013-2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "jtuner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool is_power_of_2 (int x)
+{
+    return x > 0 && ! (x & (x - 1));
+}
+
+/* Returns false if the parameters are out of range or not powers of 2. */
+
+bool config_set (JTunerConfig * cfg, int rate, int n_samples, int step_samples)
+{
+    if (rate < MIN_SAMPLERATE || rate > MAX_SAMPLERATE)
+        return false;
+    if (! is_power_of_2 (n_samples) || n_samples < MIN_SAMPLES || n_samples > MAX_SAMPLES)
+        return false;
+    if (! is_power_of_2 (step_samples) || step_samples < MIN_SAMPLES_PER_STEP ||
+     step_samples > n_samples)
+        return false;
+
+    cfg->rate = rate;
+    cfg->n_samples = n_samples;
+    cfg->step_samples = step_samples;
+    cfg->n_steps = n_samples / step_samples;
+    cfg->n_freqs = n_samples / 2 + 1;
+    cfg->slide_resync = SLIDE_RESYNC_WINDOWS * cfg->n_steps;
+
+    return true;
+}
+
+JTunerContext * context_new (const JTunerConfig * cfg)
+{
+    JTunerContext * ctx = calloc (1, sizeof (JTunerContext));
+    if (! ctx)
+        return NULL;
+
+    ctx->cfg = * cfg;
+
+    /* the lookup tables are shared by all contexts with the same sizes */
+    if (! (ctx->plan = fft_plan (cfg->n_samples, cfg->step_samples)))
+        goto ERR;
+
+    ctx->ring = malloc (cfg->n_samples * sizeof (float));
+    ctx->slide_removed = malloc (cfg->step_samples * sizeof (float));
+    if (! ctx->ring || ! ctx->slide_removed)
+        goto ERR;
+
+    /* the sliding DFT uses aligned vector loads */
+    void * re, * im;
+
+    if (posix_memalign (& re, 64, cfg->n_freqs * sizeof (float)))
+        goto ERR;
+
+    ctx->slide_re = re;
+
+    if (posix_memalign (& im, 64, cfg->n_freqs * sizeof (float)))
+        goto ERR;
+
+    ctx->slide_im = im;
+
+    context_reset (ctx);
+    return ctx;
+
+ERR:
+    context_free (ctx);
+    return NULL;
+}
+
+/* Create a context which also analyzes the same samples with up to n_levels-1
+ * shorter windows, each half as long as the last.  The step size is the same
+ * for all windows, so fewer levels are created if a window would be shorter
+ * than one step or than MIN_SAMPLES. */
+
+JTunerContext * context_new_multi (const JTunerConfig * cfg, int n_levels)
+{
+    JTunerContext * ctx = context_new (cfg);
+    JTunerContext * last = ctx;
+
+    if (n_levels > MAX_LEVELS)
+        n_levels = MAX_LEVELS;
+
+    for (int level = 1; ctx && level < n_levels; level ++)
+    {
+        JTunerConfig short_cfg;
+
+        if (! config_set (& short_cfg, cfg->rate, cfg->n_samples >> level,
+         cfg->step_samples))
+            break;
+
+        if (! (last->shorter = context_new (& short_cfg)))
+        {
+            context_free (ctx);
+            return NULL;
+        }
+
+        last = last->shorter;
+    }
+
+    return ctx;
+}
+
+/* Return a context to its initial state, as if it had just been created. */
+
+void context_reset (JTunerContext * ctx)
+{
+    memset (ctx->ring, 0, ctx->cfg.n_samples * sizeof (float));
+    ctx->n_steps = 0;
+    ctx->next_step = 0;
+
+    memset (ctx->slide_re, 0, ctx->cfg.n_freqs * sizeof (float));
+    memset (ctx->slide_im, 0, ctx->cfg.n_freqs * sizeof (float));
+    memset (ctx->slide_removed, 0, ctx->cfg.step_samples * sizeof (float));
+    ctx->slide_count = 0;
+    ctx->slide_min = 0;
+    ctx->slide_max = 0;
+
+    ctx->last_tone_hz = INVALID_VAL;
+    ctx->new_tone_hz = INVALID_VAL;
+    ctx->new_tone_steps = 0;
+
+    ctx->last_pitch = INVALID_VAL;
+    ctx->timein = 0;
+    ctx->timeout = 0;
+
+    if (ctx->shorter)
+        context_reset (ctx->shorter);
+}
+
+void context_free (JTunerContext * ctx)
+{
+    if (ctx->shorter)
+        context_free (ctx->shorter);
+
+    free (ctx->ring);
+    free (ctx->slide_re);
+    free (ctx->slide_im);
+    free (ctx->slide_removed);
+    free (ctx);
+}
+
+/* Return the buffer where the next cfg.step_samples samples should be written.
+ * This is the oldest step in the ring buffer, so the samples are never moved. */
+
+float * context_next_step (JTunerContext * ctx)
+{
+    return ctx->ring + ctx->next_step * ctx->cfg.step_samples;
+}
+
+/* Call after writing the next step.  Returns true once the ring buffer has
+ * been filled, after which the oldest sample is at next_step.  The step is
+ * also copied into the contexts for any shorter windows. */
+
+bool context_push_step (JTunerContext * ctx)
+{
+    if (ctx->shorter)
+    {
+        memcpy (context_next_step (ctx->shorter), context_next_step (ctx),
+         ctx->cfg.step_samples * sizeof (float));
+        context_push_step (ctx->shorter);
+    }
+
+    ctx->next_step = (ctx->next_step + 1) % ctx->cfg.n_steps;
+
+    if (ctx->n_steps < ctx->cfg.n_steps)
+        ctx->n_steps ++;
+
+    return ctx->n_steps == ctx->cfg.n_steps;
+}
+
+/* Call after pushing several steps without analyzing them in between.  The
+ * next call to fft_slide then does a full DFT, since the sliding DFT can only
+ * move forward one step at a time. */
+
+void context_skip_steps (JTunerContext * ctx)
+{
+    ctx->slide_count = 0;
+
+    if (ctx->shorter)
+        context_skip_steps (ctx->shorter);
+}
@@ -21,53 +21,109 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char * note_names[12] =
  {" C", "C♯", " D", "E♭", " E", " F", "F♯", " G", "A♭", " A", "B♭", " B"};
 
-static void draw_text (GtkWidget * widget, cairo_t * cr, int x, int y,
- int width, const char * text, const char * font)
+/* each part has one line of text, in one of these fonts */
+static const char * const part_fonts[N_PARTS] = {
+    [PART_NOTE] = "Sans 48",
+    [PART_TONE] = "Sans 24",
+    [PART_STRETCH] = "Sans 12",
+    [PART_DIAL] = "Sans 24",
+    [PART_INTERVALS] = "Sans 12"
+};
+
+/* Everything that can be kept from one frame to the next: a text layout for
+ * each part, which is laid out again only when its text or width changes, and
+ * the parts of the display that never change (the background and the marks on
+ * the dial), drawn once for each size of the widget. */
+struct DrawCache {
+    PangoLayout * layouts[N_PARTS];
+    cairo_surface_t * background;
+    int width, height;
+};
+
+/* the fonts are shared by all tuners */
+static PangoFontDescription * fonts[N_PARTS];
+
+DrawCache * draw_cache_new (void)
 {
-    cairo_move_to (cr, x, y);
-    cairo_set_source_rgba (cr, 1, 1, 1, 1);
+    return calloc (1, sizeof (DrawCache));
+}
+
+void draw_cache_free (DrawCache * cache)
+{
+    for (int part = 0; part < N_PARTS; part ++)
+    {
+        if (cache->layouts[part])
+            g_object_unref (cache->layouts[part]);
+    }
 
-    PangoFontDescription * desc = pango_font_description_from_string (font);
-    PangoLayout * pl = gtk_widget_create_pango_layout (widget, NULL);
-    pango_layout_set_text (pl, text, -1);
-    pango_layout_set_font_description (pl, desc);
-    pango_layout_set_width (pl, width * PANGO_SCALE);
-    pango_layout_set_alignment (pl, PANGO_ALIGN_CENTER);
-    pango_font_description_free (desc);
+    if (cache->background)
+        cairo_surface_destroy (cache->background);
 
+    free (cache);
+}
+
+static void draw_text (GtkWidget * widget, DrawCache * cache, cairo_t * cr,
+ int part, int x, int y, int width, const char * text)
+{
+    PangoLayout * pl = cache->layouts[part];
+
+    if (! pl)
+    {
+        if (! fonts[part])
+            fonts[part] = pango_font_description_from_string (part_fonts[part]);
+
+        pl = cache->layouts[part] = gtk_widget_create_pango_layout (widget, NULL);
+        pango_layout_set_font_description (pl, fonts[part]);
+        pango_layout_set_alignment (pl, PANGO_ALIGN_CENTER);
+    }
+
+    if (strcmp (pango_layout_get_text (pl), text))
+        pango_layout_set_text (pl, text, -1);
+    if (pango_layout_get_width (pl) != width * PANGO_SCALE)
+        pango_layout_set_width (pl, width * PANGO_SCALE);
+
+    cairo_move_to (cr, x, y);
+    cairo_set_source_rgba (cr, 1, 1, 1, 1);
     pango_cairo_show_layout (cr, pl);
+}
 
-    g_object_unref (pl);
+static int dial_radius (int width, int height)
+{
+    return MIN (width / 2, height * 3 / 4);
 }
 
-static void draw_dial (GtkWidget * widget, cairo_t * cr, int x, int y,
- int width, int height, bool valid, float value)
+static void draw_needle (cairo_t * cr, int x, int y, int width, int height,
+ float value)
 {
-    int radius = MIN (width / 2, height * 3 / 4);
+    int radius = dial_radius (width, height);
     int base = height - (height - radius) / 2;
 
     float angle = 0.5 * M_PI * (1 - value);
 
-    if (valid)
-    {
-        cairo_set_source_rgb (cr, 1, 1, 1);
-        cairo_set_line_width (cr, 8);
-        cairo_move_to (cr, x + width / 2, base);
-        cairo_line_to (cr, x + width / 2 + radius * cosf (angle), base - radius * sinf (angle));
-        cairo_stroke (cr);
-    }
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_set_line_width (cr, 8);
+    cairo_move_to (cr, x + width / 2, base);
+    cairo_line_to (cr, x + width / 2 + radius * cosf (angle), base - radius * sinf (angle));
+    cairo_stroke (cr);
+}
+
+static void draw_marks (cairo_t * cr, int x, int y, int width, int height)
+{
+    int radius = dial_radius (width, height);
+    int base = height - (height - radius) / 2;
 
     cairo_set_source_rgb (cr, 1, 1, 1);
     cairo_set_line_width (cr, 4);
 
     for (int i = -2; i <= 2; i ++)
     {
-        angle = M_PI * (0.5 - 0.125 * i);
+        float angle = M_PI * (0.5 - 0.125 * i);
 
         cairo_move_to (cr, x + width / 2 + 1.1 * radius * cosf (angle),
          base - 1.1 * radius * sinf (angle));
@@ -77,33 +133,28 @@ static void draw_dial (GtkWidget * widget, cairo_t * cr, int x, int y,
     }
 }
 
-void draw_tuner (GtkWidget * widget, cairo_t * cr, const DetectedTone * tone,
+void draw_format (TunerView * view, const DetectedTone * tone,
  const DetectedPitch * pitch, const Intervals * iv)
 {
-    GtkAllocation alloc;
-    gtk_widget_get_allocation (widget, & alloc);
-
-    cairo_set_source_rgb (cr, 0, 0, 0);
-    cairo_rectangle (cr, 0, 0, alloc.width, alloc.height);
-    cairo_fill (cr);
-
-    char tone_str[16], stretch[32], note[16], off_by[16], iv_str[128];
+    view->valid = (pitch->state != DETECT_NONE);
+    view->off_by = view->valid ? pitch->off_by : 0;
+    view->intervals[0] = 0;
 
-    iv_str[0] = 0;
-
-    if (pitch->state == DETECT_NONE)
+    if (! view->valid)
     {
-        sprintf (tone_str, "0.00 Hz");
-        strcpy (stretch, "");
-        strcpy (note, "—");
-        strcpy (off_by, "—");
+        sprintf (view->tone, "0.00 Hz");
+        strcpy (view->stretch, "");
+        strcpy (view->note, "—");
+        strcpy (view->off_by_str, "—");
     }
     else
     {
-        sprintf (tone_str, "%.02f Hz", tone->tone_hz);
-        sprintf (stretch, "harmonics %+.02f", tone->harm_stretch);
-        sprintf (note, "%s%d", note_names[pitch->pitch % 12], pitch->pitch / 12);
-        sprintf (off_by, "%+.02f", pitch->off_by);
+        sprintf (view->tone, "%.02f Hz", tone->tone_hz);
+        sprintf (view->stretch, "harmonics %+.02f", tone->harm_stretch);
+        sprintf (view->note, "%s%d", note_names[pitch->pitch % 12], pitch->pitch / 12);
+        sprintf (view->off_by_str, "%+.02f", pitch->off_by);
+
+        char * iv_str = view->intervals;
 
         for (int i = 0; i < iv->n_intervals; i ++)
         {
@@ -122,15 +173,148 @@ void draw_tuner (GtkWidget * widget, cairo_t * cr, const DetectedTone * tone,
              (i + 1 < N_INTERVALS) ? "  " : "");
         }
     }
+}
+
+/* The display is divided into rectangles: on the left, the note, tone, and
+ * stretch; on the right, the dial and error; and the intervals across the
+ * bottom.  Each part is clipped to its rectangle, so that any part can be
+ * redrawn on its own. */
+
+static void part_rect (int part, int width, int height, GdkRectangle * rect)
+{
+    static const int bounds[N_PARTS][4] = {
+        [PART_NOTE] = {0, 0, 4, 5},
+        [PART_TONE] = {0, 5, 4, 6},
+        [PART_STRETCH] = {0, 6, 4, 7},
+        [PART_DIAL] = {4, 0, 8, 7},
+        [PART_INTERVALS] = {0, 7, 8, 8}
+    };
+
+    /* in eighths of the width and height */
+    rect->x = width * bounds[part][0] / 8;
+    rect->y = height * bounds[part][1] / 8;
+    rect->width = width * bounds[part][2] / 8 - rect->x;
+    rect->height = height * bounds[part][3] / 8 - rect->y;
+}
+
+/* Finds the parts which look different in the new view and updates the shown
+ * view to match what will be on screen.  The dial is considered unchanged if
+ * the end of the needle moves less than half a pixel; the needle is then kept
+ * where it was drawn, so that small moves add up.  Returns the number of
+ * rectangles to be redrawn. */
+
+int draw_changes (GtkWidget * widget, TunerView * shown,
+ const TunerView * view, GdkRectangle rects[N_PARTS])
+{
+    GtkAllocation alloc;
+    gtk_widget_get_allocation (widget, & alloc);
+
+    float needle_move = 0.5f * (float) M_PI * fabsf (view->off_by - shown->off_by) *
+     dial_radius (alloc.width / 2, alloc.height * 3 / 4);
+
+    bool changed[N_PARTS] = {
+        [PART_NOTE] = strcmp (view->note, shown->note),
+        [PART_TONE] = strcmp (view->tone, shown->tone),
+        [PART_STRETCH] = strcmp (view->stretch, shown->stretch),
+        [PART_DIAL] = (view->valid != shown->valid || (view->valid && needle_move >= 0.5f) ||
+         strcmp (view->off_by_str, shown->off_by_str)),
+        [PART_INTERVALS] = strcmp (view->intervals, shown->intervals)
+    };
+
+    int n_rects = 0;
+
+    for (int part = 0; part < N_PARTS; part ++)
+    {
+        if (changed[part])
+            part_rect (part, alloc.width, alloc.height, & rects[n_rects ++]);
+    }
+
+    float off_by = shown->off_by;
+    * shown = * view;
+
+    if (! changed[PART_DIAL])
+        shown->off_by = off_by;
+
+    return n_rects;
+}
+
+static cairo_surface_t * get_background (DrawCache * cache, cairo_t * cr,
+ int width, int height)
+{
+    if (cache->background && cache->width == width && cache->height == height)
+        return cache->background;
 
-    draw_text (widget, cr, 0, alloc.height / 4, alloc.width / 2, note, "Sans 48");
-    draw_text (widget, cr, 0, alloc.height * 5 / 8, alloc.width / 2, tone_str, "Sans 24");
-    draw_text (widget, cr, 0, alloc.height * 3 / 4, alloc.width / 2, stretch, "Sans 12");
+    if (cache->background)
+        cairo_surface_destroy (cache->background);
 
-    draw_dial (widget, cr, alloc.width / 2, 0, alloc.width / 2,
-     alloc.height * 3 / 4, pitch->state != DETECT_NONE, pitch->off_by);
-    draw_text (widget, cr, alloc.width / 2, alloc.height * 5 / 8,
-     alloc.width / 2, off_by, "Sans 24");
+    cache->background = cairo_surface_create_similar (cairo_get_target (cr),
+     CAIRO_CONTENT_COLOR, width, height);
+    cache->width = width;
+    cache->height = height;
 
-    draw_text (widget, cr, 0, alloc.height * 7 / 8, alloc.width, iv_str, "Sans 12");
+    cairo_t * bg = cairo_create (cache->background);
+
+    cairo_set_source_rgb (bg, 0, 0, 0);
+    cairo_paint (bg);
+    draw_marks (bg, width / 2, 0, width / 2, height * 3 / 4);
+
+    cairo_destroy (bg);
+
+    return cache->background;
+}
+
+/* Only the parts within area are drawn. */
+
+void draw_tuner (GtkWidget * widget, DrawCache * cache, cairo_t * cr,
+ const GdkRectangle * area, const TunerView * view)
+{
+    GtkAllocation alloc;
+    gtk_widget_get_allocation (widget, & alloc);
+
+    cairo_surface_t * background = get_background (cache, cr, alloc.width, alloc.height);
+
+    for (int part = 0; part < N_PARTS; part ++)
+    {
+        GdkRectangle rect, common;
+        part_rect (part, alloc.width, alloc.height, & rect);
+
+        if (! gdk_rectangle_intersect (area, & rect, & common))
+            continue;
+
+        cairo_save (cr);
+        cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+        cairo_clip (cr);
+
+        cairo_set_source_surface (cr, background, 0, 0);
+        cairo_paint (cr);
+
+        switch (part)
+        {
+        case PART_NOTE:
+            draw_text (widget, cache, cr, part, 0, alloc.height / 4,
+             alloc.width / 2, view->note);
+            break;
+        case PART_TONE:
+            draw_text (widget, cache, cr, part, 0, alloc.height * 5 / 8,
+             alloc.width / 2, view->tone);
+            break;
+        case PART_STRETCH:
+            draw_text (widget, cache, cr, part, 0, alloc.height * 3 / 4,
+             alloc.width / 2, view->stretch);
+            break;
+        case PART_DIAL:
+            if (view->valid)
+                draw_needle (cr, alloc.width / 2, 0, alloc.width / 2,
+                 alloc.height * 3 / 4, view->off_by);
+            draw_text (widget, cache, cr, part, alloc.width / 2,
+             alloc.height * 5 / 8, alloc.width / 2, view->off_by_str);
+            break;
+        case PART_INTERVALS:
+            draw_text (widget, cache, cr, part, 0, alloc.height * 7 / 8,
+             alloc.width, view->intervals);
+            break;
+        }
+
+        cairo_restore (cr);
+    }
 }
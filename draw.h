@@ -24,7 +24,33 @@
 
 #include <gtk/gtk.h>
 
-void draw_tuner (GtkWidget * widget, cairo_t * cr, const DetectedTone * tone,
+/* The parts of the tuner display, each drawn in its own rectangle */
+typedef enum {
+    PART_NOTE,
+    PART_TONE,
+    PART_STRETCH,
+    PART_DIAL,          /* includes the error below the dial */
+    PART_INTERVALS,
+    N_PARTS
+} TunerPart;
+
+/* Everything shown by the tuner, formatted for display */
+typedef struct {
+    bool valid;
+    float off_by;
+    char note[16], tone[16], stretch[32], off_by_str[16], intervals[128];
+} TunerView;
+
+/* Layouts and surfaces kept from one frame to the next, one for each tuner */
+typedef struct DrawCache DrawCache;
+
+DrawCache * draw_cache_new (void);
+void draw_cache_free (DrawCache * cache);
+void draw_format (TunerView * view, const DetectedTone * tone,
  const DetectedPitch * pitch, const Intervals * iv);
+int draw_changes (GtkWidget * widget, TunerView * shown,
+ const TunerView * view, GdkRectangle rects[N_PARTS]);
+void draw_tuner (GtkWidget * widget, DrawCache * cache, cairo_t * cr,
+ const GdkRectangle * area, const TunerView * view);
 
 #endif // JTUNER_DRAW_H
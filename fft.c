@@ -21,21 +21,79 @@
 
 #include <complex.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
 
-#define N     N_SAMPLES         /* size of the DFT */
-#define LOGN  N_SAMPLES_LOG2    /* log N (base 2) */
+/* Throughout this file, N is the size of the DFT (the window size), M=N/2 is
+ * the size of the complex DFT, H is the number of samples per step of the
+ * sliding DFT, and R=N/H is the number of steps per window. */
 
-static float hamming[N];              /* hamming window, scaled to sum to 1 */
-static int reversed[N];               /* bit-reversal table */
-static float complex roots[N / 2];    /* N-th roots of unity */
+/* Vectors of 16 floats are used for the butterfly kernels.  GCC splits these
+ * into whatever registers the target has (one AVX-512 register, two AVX or
+ * four SSE/NEON registers) or falls back to scalar code. */
+#define VEC   16
 
-/* Reverse the order of the lowest LOGN bits in an integer. */
+typedef float vfloat __attribute__ ((vector_size (VEC * sizeof (float))));
 
-static int bit_reverse (int x)
+/* The same, for loads and stores which need not be aligned */
+typedef float vfloat_u __attribute__ ((vector_size (VEC * sizeof (float)),
+ aligned (sizeof (float))));
+
+#define ALIGNED __attribute__ ((aligned (VEC * sizeof (float))))
+
+#define HAMMING_A 0.85f
+
+/* Twiddle factors for each radix-4 step.  For the step which combines four
+ * DFTs of length L, the factors w^b, w^2b, and w^3b, where w is the (4L)-th
+ * root of unity and b=0..L-1, are stored contiguously at index L+b.  These do
+ * not depend on the size of the DFT, so one table serves all sizes. */
+static float twiddle_re[3][MAX_SAMPLES / 4] ALIGNED;
+static float twiddle_im[3][MAX_SAMPLES / 4] ALIGNED;
+
+static void (* fft_run_internal) (float * re, float * im, int size);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* The remaining tables depend on N and H.  They are created the first time a
+ * given pair of sizes is used and kept until the program exits. */
+struct FFTPlan {
+    int n, h;
+    float * hamming;            /* hamming window, scaled to sum to 1 */
+    int * reversed;             /* bit-reversal table */
+    float complex * roots;      /* N-th roots of unity, up to N/4 */
+
+    /* lookup tables for the sliding DFT (see slide_update) */
+    float * slide_mod_re;       /* R rows of H/2 values */
+    float * slide_mod_im;
+    float complex * slide_rot;
+
+    FFTPlan * next;
+};
+
+static FFTPlan * plans;
+static pthread_mutex_t plans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The functions marked SIZED take N (and R if needed) as their last arguments.
+ * The public functions call them through SPECIALIZE, which expands to two
+ * inlined copies of the function.  The first is used for the default sizes and
+ * gets them as constants, so that the compiler can fix the loop counts and
+ * turn divisions and modulos into shifts and masks.  Other sizes use the
+ * second copy. */
+
+#define SIZED static inline __attribute__ ((always_inline))
+
+#define SPECIALIZE(cfg, func, ...) \
+    (((cfg)->n_samples == N_SAMPLES && (cfg)->step_samples == SAMPLES_PER_STEP) ? \
+     func (__VA_ARGS__, N_SAMPLES, N_SAMPLES / SAMPLES_PER_STEP) : \
+     func (__VA_ARGS__, (cfg)->n_samples, (cfg)->n_steps))
+
+/* Reverse the order of the lowest n_bits bits in an integer. */
+
+static int bit_reverse (int x, int n_bits)
 {
     int y = 0;
 
-    for (int n = LOGN; n --; )
+    for (int n = n_bits; n --; )
     {
         y = (y << 1) | (x & 1);
         x >>= 1;
@@ -44,71 +102,535 @@ static int bit_reverse (int x)
     return y;
 }
 
-/* Generate lookup tables. */
+/* Combine groups of four DFTs of length L into DFTs of length 4L.  Since the
+ * input is in bit-reversed order, the four DFTs within each group are those of
+ * the input values with indexes 0, 2, 1, and 3 (modulo 4), in that order. */
 
-void fft_init (void)
+static inline __attribute__ ((always_inline))
+void radix4_step (float * re, float * im, int size, int L)
 {
-    for (int n = 0; n < N; n ++)
-        hamming[n] = 1 - 0.85f * cosf (2 * (float) M_PI * n / N);
-    for (int n = 0; n < N; n ++)
-        reversed[n] = bit_reverse (n);
-    for (int n = 0; n < N / 2; n ++)
-        roots[n] = cexpf (2 * (float) M_PI * I * n / N);
+    const float * w1re = twiddle_re[0] + L, * w1im = twiddle_im[0] + L;
+    const float * w2re = twiddle_re[1] + L, * w2im = twiddle_im[1] + L;
+    const float * w3re = twiddle_re[2] + L, * w3im = twiddle_im[2] + L;
+
+    /* loop through groups */
+    for (int g = 0; g < size; g += L << 2)
+    {
+        /* loop through butterflies */
+        for (int b = 0; b < L; b ++)
+        {
+            int n0 = g + b, n2 = n0 + L, n1 = n2 + L, n3 = n1 + L;
+
+            float a0re = re[n0], a0im = im[n0];
+            float a1re = re[n1] * w1re[b] - im[n1] * w1im[b];
+            float a1im = re[n1] * w1im[b] + im[n1] * w1re[b];
+            float a2re = re[n2] * w2re[b] - im[n2] * w2im[b];
+            float a2im = re[n2] * w2im[b] + im[n2] * w2re[b];
+            float a3re = re[n3] * w3re[b] - im[n3] * w3im[b];
+            float a3im = re[n3] * w3im[b] + im[n3] * w3re[b];
+
+            float t0re = a0re + a2re, t0im = a0im + a2im;
+            float t1re = a0re - a2re, t1im = a0im - a2im;
+            float t2re = a1re + a3re, t2im = a1im + a3im;
+            float t3re = a1re - a3re, t3im = a1im - a3im;
+
+            re[g + b] = t0re + t2re;
+            im[g + b] = t0im + t2im;
+            re[g + L + b] = t1re - t3im;
+            im[g + L + b] = t1im + t3re;
+            re[g + 2 * L + b] = t0re - t2re;
+            im[g + 2 * L + b] = t0im - t2im;
+            re[g + 3 * L + b] = t1re + t3im;
+            im[g + 3 * L + b] = t1im - t3re;
+        }
+    }
 }
 
-/* Perform the DFT using the Cooley-Tukey algorithm.  At each step s, where
- * s=1..log N (base 2), there are N/(2^s) groups of intertwined butterfly
- * operations.  Each group contains (2^s)/2 butterflies, and each butterfly has
- * a span of (2^s)/2.  The twiddle factors are nth roots of unity where n = 2^s. */
+/* Same as radix4_step, but processing VEC butterflies at a time.  L must be a
+ * multiple of VEC. */
+
+#define LOAD(a, n) (* (const vfloat *) ((a) + (n)))
+#define STORE(a, n, v) (* (vfloat *) ((a) + (n)) = (v))
+#define LOADU(a, n) (* (const vfloat_u *) ((a) + (n)))
+#define STOREU(a, n, v) (* (vfloat_u *) ((a) + (n)) = (v))
 
-static void fft_run_internal (float complex a[N])
+static inline __attribute__ ((always_inline))
+void radix4_step_vec (float * re, float * im, int size, int L)
 {
-    int half = 1;       /* (2^s)/2 */
-    int inv = N / 2;    /* N/(2^s) */
+    const float * w1re = twiddle_re[0] + L, * w1im = twiddle_im[0] + L;
+    const float * w2re = twiddle_re[1] + L, * w2im = twiddle_im[1] + L;
+    const float * w3re = twiddle_re[2] + L, * w3im = twiddle_im[2] + L;
 
-    /* loop through steps */
-    while (inv)
+    /* loop through groups */
+    for (int g = 0; g < size; g += L << 2)
     {
-        /* loop through groups */
-        for (int g = 0; g < N; g += half << 1)
+        /* loop through butterflies */
+        for (int b = 0; b < L; b += VEC)
         {
-            /* loop through butterflies */
-            for (int b = 0, r = 0; b < half; b ++, r += inv)
+            int n0 = g + b, n2 = n0 + L, n1 = n2 + L, n3 = n1 + L;
+
+            vfloat a0re = LOAD (re, n0), a0im = LOAD (im, n0);
+            vfloat a1re = LOAD (re, n1) * LOAD (w1re, b) - LOAD (im, n1) * LOAD (w1im, b);
+            vfloat a1im = LOAD (re, n1) * LOAD (w1im, b) + LOAD (im, n1) * LOAD (w1re, b);
+            vfloat a2re = LOAD (re, n2) * LOAD (w2re, b) - LOAD (im, n2) * LOAD (w2im, b);
+            vfloat a2im = LOAD (re, n2) * LOAD (w2im, b) + LOAD (im, n2) * LOAD (w2re, b);
+            vfloat a3re = LOAD (re, n3) * LOAD (w3re, b) - LOAD (im, n3) * LOAD (w3im, b);
+            vfloat a3im = LOAD (re, n3) * LOAD (w3im, b) + LOAD (im, n3) * LOAD (w3re, b);
+
+            vfloat t0re = a0re + a2re, t0im = a0im + a2im;
+            vfloat t1re = a0re - a2re, t1im = a0im - a2im;
+            vfloat t2re = a1re + a3re, t2im = a1im + a3im;
+            vfloat t3re = a1re - a3re, t3im = a1im - a3im;
+
+            STORE (re, g + b, t0re + t2re);
+            STORE (im, g + b, t0im + t2im);
+            STORE (re, g + L + b, t1re - t3im);
+            STORE (im, g + L + b, t1im + t3re);
+            STORE (re, g + 2 * L + b, t0re - t2re);
+            STORE (im, g + 2 * L + b, t0im - t2im);
+            STORE (re, g + 3 * L + b, t1re + t3im);
+            STORE (im, g + 3 * L + b, t1im - t3re);
+        }
+    }
+}
+
+/* Perform a DFT of the given size (a power of 2, up to MAX_SAMPLES/2) using the
+ * Cooley-Tukey algorithm.  Each step combines groups of four DFTs of length L
+ * into DFTs of length 4L, where L=1,4,16...  If log size (base 2) is odd, a
+ * radix-2 step is done first.  Steps with at least VEC butterflies per group
+ * use the vector kernel. */
+
+static inline __attribute__ ((always_inline))
+void fft_run_generic (float * re, float * im, int size)
+{
+    int L = 1;
+
+    if (__builtin_ctz (size) % 2)
+    {
+        for (int g = 0; g < size; g += 2)
+        {
+            float ere = re[g], eim = im[g];
+            re[g] = ere + re[g + 1];
+            im[g] = eim + im[g + 1];
+            re[g + 1] = ere - re[g + 1];
+            im[g + 1] = eim - im[g + 1];
+        }
+
+        L = 2;
+    }
+
+    for (; L < size && L < VEC; L <<= 2)
+        radix4_step (re, im, size, L);
+    for (; L < size; L <<= 2)
+        radix4_step_vec (re, im, size, L);
+}
+
+/* The same code is compiled for each supported instruction set, and the best
+ * one is chosen at runtime by init_shared. */
+
+static void fft_run_default (float * re, float * im, int size)
+    { fft_run_generic (re, im, size); }
+
+#if defined (__x86_64__) || defined (__i386__)
+__attribute__ ((target ("sse2")))
+static void fft_run_sse2 (float * re, float * im, int size)
+    { fft_run_generic (re, im, size); }
+
+__attribute__ ((target ("avx2,fma")))
+static void fft_run_avx2 (float * re, float * im, int size)
+    { fft_run_generic (re, im, size); }
+
+__attribute__ ((target ("avx512f")))
+static void fft_run_avx512 (float * re, float * im, int size)
+    { fft_run_generic (re, im, size); }
+#endif
+
+static void init_shared (void)
+{
+    for (int L = 1; L <= MAX_SAMPLES / 8; L <<= 1)
+    {
+        for (int b = 0; b < L; b ++)
+        {
+            for (int k = 1; k <= 3; k ++)
             {
-                float complex even = a[g + b];
-                float complex odd = roots[r] * a[g + half + b];
-                a[g + b] = even + odd;
-                a[g + half + b] = even - odd;
+                float complex w = cexpf (2 * (float) M_PI * I * k * b / (4 * L));
+                twiddle_re[k - 1][L + b] = crealf (w);
+                twiddle_im[k - 1][L + b] = cimagf (w);
             }
         }
+    }
+
+    fft_run_internal = fft_run_default;
+
+#if defined (__x86_64__) || defined (__i386__)
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx512f"))
+        fft_run_internal = fft_run_avx512;
+    else if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+        fft_run_internal = fft_run_avx2;
+    else if (__builtin_cpu_supports ("sse2"))
+        fft_run_internal = fft_run_sse2;
+#endif
+}
+
+static FFTPlan * plan_new (int N, int H)
+{
+    int M = N / 2, R = N / H;
+
+    FFTPlan * p = calloc (1, sizeof (FFTPlan));
+    if (! p)
+        return NULL;
+
+    p->n = N;
+    p->h = H;
+    p->hamming = malloc (N * sizeof (float));
+    p->reversed = malloc (M * sizeof (int));
+    p->roots = malloc ((M / 2 + 1) * sizeof (float complex));
+    p->slide_mod_re = malloc (R * (H / 2) * sizeof (float));
+    p->slide_mod_im = malloc (R * (H / 2) * sizeof (float));
+    p->slide_rot = malloc (R * sizeof (float complex));
+
+    if (! p->hamming || ! p->reversed || ! p->roots || ! p->slide_mod_re ||
+     ! p->slide_mod_im || ! p->slide_rot)
+    {
+        free (p->hamming);
+        free (p->reversed);
+        free (p->roots);
+        free (p->slide_mod_re);
+        free (p->slide_mod_im);
+        free (p->slide_rot);
+        free (p);
+        return NULL;
+    }
+
+    for (int n = 0; n < N; n ++)
+        p->hamming[n] = 1 - HAMMING_A * cosf (2 * (float) M_PI * n / N);
+    for (int n = 0; n < M; n ++)
+        p->reversed[n] = bit_reverse (n, __builtin_ctz (M));
+    for (int n = 0; n <= M / 2; n ++)
+        p->roots[n] = cexpf (2 * (float) M_PI * I * n / N);
+
+    int shift = __builtin_ctz (M) - __builtin_ctz (H / 2);
+
+    for (int r = 0; r < R; r ++)
+    {
+        for (int m = 0; m < H / 2; m ++)
+        {
+            float complex w = cexpf (4 * (float) M_PI * I * r * m / N);
+            p->slide_mod_re[r * (H / 2) + (p->reversed[m] >> shift)] = crealf (w);
+            p->slide_mod_im[r * (H / 2) + (p->reversed[m] >> shift)] = cimagf (w);
+        }
+
+        p->slide_rot[r] = cexpf (-2 * (float) M_PI * I * r / R);
+    }
+
+    return p;
+}
+
+/* Return the lookup tables for the given window and step sizes (powers of 2,
+ * validated by config_set), generating them if needed.  The tables never
+ * change afterward, so this may be called any number of times from any
+ * thread.  Returns NULL if out of memory. */
+
+const FFTPlan * fft_plan (int n_samples, int step_samples)
+{
+    pthread_once (& init_once, init_shared);
+
+    pthread_mutex_lock (& plans_mutex);
+
+    FFTPlan * p = plans;
+
+    while (p && (p->n != n_samples || p->h != step_samples))
+        p = p->next;
+
+    if (! p && (p = plan_new (n_samples, step_samples)))
+    {
+        p->next = plans;
+        plans = p;
+    }
+
+    pthread_mutex_unlock (& plans_mutex);
+
+    return p;
+}
+
+/* Since the input is real, the even and odd samples are packed into the real
+ * and imaginary parts of an N/2-point complex DFT.  The spectra of the even
+ * and odd halves are then separated using their conjugate symmetry and
+ * combined into the N-point spectrum with one more set of twiddle factors.
+ *
+ * Given values z1 and z2 of the N/2-point DFT at k and N/2-k, where k=0..N/4,
+ * this function computes frequencies k and N/2-k. */
+
+static inline void split_bins (const FFTPlan * p, int k, float complex z1,
+ float complex z2, float complex * x1, float complex * x2)
+{
+    z2 = conjf (z2);
+
+    float complex even = 0.5f * (z1 + z2);
+    float complex odd = -0.5f * I * (z1 - z2);
+    float complex twiddled = p->roots[k] * odd;
 
-        half <<= 1;
-        inv >>= 1;
+    * x1 = even + twiddled;
+    * x2 = conjf (even - twiddled);
+}
+
+/* On input, the arrays contain the N/2-point DFT of the packed samples.  On
+ * output, they contain frequencies from 0 to N/2. */
+
+SIZED void split_spectrum (const FFTPlan * p, float re[], float im[], int N)
+{
+    int M = N / 2;
+
+    re[M] = re[0];
+    im[M] = im[0];
+
+    for (int k = 0; k <= M / 2; k ++)
+    {
+        float complex x1, x2;
+        split_bins (p, k, re[k] + I * im[k], re[M - k] + I * im[M - k], & x1, & x2);
+
+        re[k] = crealf (x1);
+        im[k] = cimagf (x1);
+        re[M - k] = crealf (x2);
+        im[M - k] = cimagf (x2);
     }
 }
 
-/* Input is N PCM samples.
- * Output is intensity of frequencies from 0 to N/2. */
+/* Squared magnitudes of bins lo to hi-1, multiplied by scale.  No square roots
+ * are taken here; tone_detect needs the magnitudes of only a few peaks. */
 
-void fft_run (const float data[N], float freqs[N / 2 + 1])
+static void power_spectrum (const float re[], const float im[], float power[],
+ int lo, int hi, float scale)
 {
-    float complex a[N];
+    int k = lo;
+
+    for (; k + VEC <= hi; k += VEC)
+    {
+        vfloat_u yre = LOADU (re, k), yim = LOADU (im, k);
+        STOREU (power, k, (yre * yre + yim * yim) * scale);
+    }
 
-    /* input is filtered by a Hamming window */
+    for (; k < hi; k ++)
+        power[k] = (re[k] * re[k] + im[k] * im[k]) * scale;
+}
+
+/* Input is the N samples in the ring buffer of the context.  Output is the
+ * power (squared magnitude) of frequencies from 0 to N/2. */
+
+SIZED void fft_run_sized (const JTunerContext * ctx, float freqs[], int N, int R)
+{
+    const FFTPlan * p = ctx->plan;
+    int M = N / 2;
+
+    /* the oldest sample in the ring buffer is the start of the window */
+    const float * ring = ctx->ring;
+    int start = ctx->next_step * (N / R);
+
+    float re[M + 1] ALIGNED, im[M + 1] ALIGNED;
+
+    /* input is read in place and filtered by a Hamming window */
     /* input values are in bit-reversed order */
-    for (int n = 0; n < N; n ++)
-        a[reversed[n]] = data[n] * hamming[n];
+    for (int n = 0; n < M; n ++)
+    {
+        int i = (start + 2 * n) & (N - 1);
+        re[p->reversed[n]] = ring[i] * p->hamming[2 * n];
+        im[p->reversed[n]] = ring[i + 1] * p->hamming[2 * n + 1];
+    }
+
+    fft_run_internal (re, im, M);
+    split_spectrum (p, re, im, N);
+
+    /* output values are divided by N (so powers by N^2) */
+    /* frequencies from 1 to N/2-1 are doubled */
+    power_spectrum (re, im, freqs, 0, M + 1, 4.0f / ((float) N * N));
+
+    /* frequencies 0 and N/2 are not doubled */
+    freqs[0] *= 0.25f;
+    freqs[M] *= 0.25f;
+}
+
+void fft_run (const JTunerContext * ctx, float freqs[])
+{
+    SPECIALIZE (& ctx->cfg, fft_run_sized, ctx, freqs);
+}
+
+/* Update the sliding DFT for a window that has moved forward by H samples.
+ * The new spectrum is X'[k] = w^-kH * (X[k] + D[k]), where w is the N-th root
+ * of unity and D is the DFT of the difference between the H samples entering
+ * and leaving the window, zero-padded to N samples.
+ *
+ * D is computed like the spectrum in fft_run, by packing the difference into
+ * H/2 complex values and doing an N/2-point DFT.  Since only H/2 of the input
+ * values are non-zero, the N/2-point DFT is split into R interleaved DFTs of
+ * H/2 points each, the r-th of which has its input multiplied by the (N/2)-th
+ * roots of unity w^2rm.  The total cost is O(N log H) rather than O(N log N).
+ *
+ * Only bins lo to hi are updated.  The sub-DFTs are always done in full, but
+ * the remaining per-bin work is limited to the bins in range. */
+
+SIZED void slide_update (JTunerContext * ctx, const float added[], int lo,
+ int hi, int N, int R)
+{
+    const FFTPlan * p = ctx->plan;
+    int M = N / 2, H = N / R;
+
+    float * re = ctx->slide_re, * im = ctx->slide_im;
+    float d_re[H / 2] ALIGNED, d_im[H / 2] ALIGNED;
+    float sub_re[R][H / 2] ALIGNED, sub_im[R][H / 2] ALIGNED;
 
-    fft_run_internal (a);
+    const float (* mod_re)[H / 2] = (const float (*)[H / 2]) p->slide_mod_re;
+    const float (* mod_im)[H / 2] = (const float (*)[H / 2]) p->slide_mod_im;
+
+    int shift = __builtin_ctz (M) - __builtin_ctz (H / 2);
+
+    /* input values are in bit-reversed order */
+    for (int m = 0; m < H / 2; m ++)
+    {
+        d_re[p->reversed[m] >> shift] = added[2 * m] - ctx->slide_removed[2 * m];
+        d_im[p->reversed[m] >> shift] = added[2 * m + 1] - ctx->slide_removed[2 * m + 1];
+    }
+
+    for (int r = 0; r < R; r ++)
+    {
+        for (int j = 0; j < H / 2; j ++)
+        {
+            sub_re[r][j] = d_re[j] * mod_re[r][j] - d_im[j] * mod_im[r][j];
+            sub_im[r][j] = d_re[j] * mod_im[r][j] + d_im[j] * mod_re[r][j];
+        }
+
+        fft_run_internal (sub_re[r], sub_im[r], H / 2);
+    }
 
-    /* output values are divided by N */
-    /* frequency 0 (constant component) is not doubled */
-    freqs[0] = cabsf (a[0]) / N;
+    /* bins k and N/2-k are computed together, where k=0..N/4 */
+    int klo = (hi > M / 2 && M - hi < lo) ? M - hi : lo;
+    int khi = (hi < M / 2) ? hi : M / 2;
 
+    /* value k of the N/2-point DFT is value k/R of the (k%R)-th sub-DFT */
+    for (int k = klo; k <= khi; k ++)
+    {
+        int k2 = (M - k) % M;
+
+        float complex x1, x2;
+        split_bins (p, k, sub_re[k % R][k / R] + I * sub_im[k % R][k / R],
+         sub_re[k2 % R][k2 / R] + I * sub_im[k2 % R][k2 / R], & x1, & x2);
+
+        if (k >= lo)
+        {
+            x1 = (re[k] + I * im[k] + x1) * p->slide_rot[k % R];
+            re[k] = crealf (x1);
+            im[k] = cimagf (x1);
+        }
+
+        if (k < M / 2 && M - k >= lo && M - k <= hi)
+        {
+            x2 = (re[M - k] + I * im[M - k] + x2) * p->slide_rot[(M - k) % R];
+            re[M - k] = crealf (x2);
+            im[M - k] = cimagf (x2);
+        }
+    }
+}
+
+/* Like fft_run, but for a window that has moved forward by exactly
+ * cfg.step_samples samples since the last call (except for the first call).
+ * The spectrum is updated incrementally using a sliding DFT.
+ *
+ * Only frequencies from min_bin to max_bin are computed; the others are set to
+ * zero.  If the range grows from one call to the next, a full DFT is done to
+ * bring the newly included bins up to date.
+ *
+ * As long as the range does not grow, full DFTs are done every
+ * cfg.slide_resync calls, counting from the first.  So two contexts fed the
+ * same samples give identical results, if one was started a multiple of
+ * cfg.slide_resync steps after the other. */
+
+SIZED void fft_slide_sized (JTunerContext * ctx, float freqs[], int min_bin,
+ int max_bin, int N, int R)
+{
+    const FFTPlan * p = ctx->plan;
+    int M = N / 2, H = N / R;
+
+    /* the oldest sample in the ring buffer is the start of the window */
+    const float * ring = ctx->ring;
+    int start = ctx->next_step * H;
+
+    float * re = ctx->slide_re, * im = ctx->slide_im;
+
+    /* the Hamming window needs one more bin on each side */
+    int lo = (min_bin > 0) ? min_bin - 1 : 0;
+    int hi = (max_bin < M) ? max_bin + 1 : M;
+
+    if (! ctx->slide_count || lo < ctx->slide_min || hi > ctx->slide_max)
+    {
+        /* input is read in place */
+        /* input values are in bit-reversed order */
+        for (int n = 0; n < M; n ++)
+        {
+            int i = (start + 2 * n) & (N - 1);
+            re[p->reversed[n]] = ring[i];
+            im[p->reversed[n]] = ring[i + 1];
+        }
+
+        fft_run_internal (re, im, M);
+        split_spectrum (p, re, im, N);
+
+        ctx->slide_count = 0;
+    }
+    else
+        slide_update (ctx, ring + ((start + N - H) & (N - 1)), lo, hi, N, R);
+
+    ctx->slide_count = (ctx->slide_count + 1) % ctx->cfg.slide_resync;
+    ctx->slide_min = lo;
+    ctx->slide_max = hi;
+
+    for (int n = 0; n < H; n ++)
+        ctx->slide_removed[n] = ring[start + n];
+
+    for (int k = 0; k < min_bin; k ++)
+        freqs[k] = 0;
+    for (int k = max_bin + 1; k <= M; k ++)
+        freqs[k] = 0;
+
+    /* the Hamming window is applied in the frequency domain: multiplying by
+     * cos(2 pi n / N) is equivalent to averaging bins k-1 and k+1 */
+    /* output values are divided by N (so powers by N^2) */
     /* frequencies from 1 to N/2-1 are doubled */
-    for (int n = 1; n < N / 2; n ++)
-        freqs[n] = 2 * cabsf (a[n]) / N;
+    float scale = 4.0f / ((float) N * N);
+    int k = lo + 1;
+
+    for (; k + VEC <= hi; k += VEC)
+    {
+        vfloat_u yre = LOADU (re, k) - (0.5f * HAMMING_A) * (LOADU (re, k - 1) + LOADU (re, k + 1));
+        vfloat_u yim = LOADU (im, k) - (0.5f * HAMMING_A) * (LOADU (im, k - 1) + LOADU (im, k + 1));
+
+        STOREU (freqs, k, (yre * yre + yim * yim) * scale);
+    }
+
+    for (; k < hi; k ++)
+    {
+        float yre = re[k] - 0.5f * HAMMING_A * (re[k - 1] + re[k + 1]);
+        float yim = im[k] - 0.5f * HAMMING_A * (im[k - 1] + im[k + 1]);
+
+        freqs[k] = (yre * yre + yim * yim) * scale;
+    }
+
+    /* bins -1 and N/2+1 are the conjugates of bins 1 and N/2-1 */
+    /* frequencies 0 and N/2 are not doubled */
+    if (min_bin == 0)
+    {
+        float y = (re[0] - HAMMING_A * re[1]) / N;
+        freqs[0] = y * y;
+    }
 
-    /* frequency N/2 is not doubled */
-    freqs[N / 2] = cabsf (a[N / 2]) / N;
+    if (max_bin == M)
+    {
+        float y = (re[M] - HAMMING_A * re[M - 1]) / N;
+        freqs[M] = y * y;
+    }
+}
+
+void fft_slide (JTunerContext * ctx, float freqs[], int min_bin, int max_bin)
+{
+    SPECIALIZE (& ctx->cfg, fft_slide_sized, ctx, freqs, min_bin, max_bin);
 }
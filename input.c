@@ -0,0 +1,434 @@
+/*
+ * JTuner - input.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * File input for jtuner-offline.  Regular files are memory-mapped and the
+ * samples are converted directly from the mapping; anything else (such as a
+ * pipe) is read in streaming mode, one step at a time.
+ *
+ * WAV files may contain 8, 16, 24, or 32-bit integer or 32-bit float samples,
+ * with any number of channels, which are mixed down to mono.  Files without a
+ * WAV header are read as raw 16-bit mono samples.
+ */
+
+#include "jtuner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+typedef enum {
+    FORMAT_U8,
+    FORMAT_S16,
+    FORMAT_S24,
+    FORMAT_S32,
+    FORMAT_FLOAT
+} SampleFormat;
+
+struct InputFile {
+    FILE * file;              /* streaming mode only */
+    uint8_t * buf;            /* one step of data (streaming mode only) */
+    uint8_t head[12];         /* first bytes, read to check the format */
+    int head_len, head_pos;
+
+    uint8_t * map;            /* whole file (mapped mode only) */
+    long map_size;
+
+    long pos;                 /* current offset in the file */
+    long data_start;          /* offset of the first sample */
+    long data_end;            /* offset past the last sample, or -1 */
+
+    SampleFormat format;
+    int rate;                 /* from the WAV header, or 0 if unknown */
+    int channels;
+    int frame_bytes;          /* bytes per sample times channels */
+    int step_samples;
+};
+
+/* Reading and skipping work the same way in both modes, so that the header
+ * can be parsed without seeking. */
+
+static bool in_read (InputFile * in, void * buf, long len)
+{
+    if (in->map)
+    {
+        if (in->pos + len > in->map_size)
+            return false;
+
+        memcpy (buf, in->map + in->pos, len);
+    }
+    else
+    {
+        /* in streaming mode, the bytes read to check the format come first */
+        long from_head = in->head_len - in->head_pos;
+        if (from_head > len)
+            from_head = len;
+
+        memcpy (buf, in->head + in->head_pos, from_head);
+        in->head_pos += from_head;
+
+        if (fread ((uint8_t *) buf + from_head, 1, len - from_head, in->file)
+         != (size_t) (len - from_head))
+            return false;
+    }
+
+    in->pos += len;
+    return true;
+}
+
+static bool in_skip (InputFile * in, long len)
+{
+    uint8_t tmp[256];
+
+    if (in->map)
+    {
+        if (in->pos + len > in->map_size)
+            return false;
+
+        in->pos += len;
+        return true;
+    }
+
+    while (len > 0)
+    {
+        long chunk = (len < (long) sizeof tmp) ? len : (long) sizeof tmp;
+
+        if (! in_read (in, tmp, chunk))
+            return false;
+
+        len -= chunk;
+    }
+
+    return true;
+}
+
+static int get_le16 (const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static long get_le32 (const uint8_t * p)
+{
+    return (long) p[0] | ((long) p[1] << 8) | ((long) p[2] << 16) | ((long) p[3] << 24);
+}
+
+static bool set_format (InputFile * in, int tag, int bits, int channels)
+{
+    if (tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32)
+        in->format = FORMAT_FLOAT;
+    else if (tag != WAVE_FORMAT_PCM)
+        return false;
+    else if (bits == 8)
+        in->format = FORMAT_U8;
+    else if (bits == 16)
+        in->format = FORMAT_S16;
+    else if (bits == 24)
+        in->format = FORMAT_S24;
+    else if (bits == 32)
+        in->format = FORMAT_S32;
+    else
+        return false;
+
+    if (channels < 1)
+        return false;
+
+    in->channels = channels;
+    in->frame_bytes = channels * (bits / 8);
+
+    return true;
+}
+
+/* Called after the RIFF/WAVE header has been read.  Reads chunks up to and
+ * including the header of the "data" chunk. */
+
+static bool parse_wav (InputFile * in)
+{
+    bool have_format = false;
+    uint8_t chunk[8];
+
+    while (in_read (in, chunk, 8))
+    {
+        long size = get_le32 (chunk + 4);
+
+        if (! memcmp (chunk, "fmt ", 4))
+        {
+            uint8_t fmt[40] = {0};
+
+            if (size < 16 || ! in_read (in, fmt, (size < 40) ? size : 40) ||
+             (size > 40 && ! in_skip (in, size - 40)) || ! in_skip (in, size & 1))
+                return false;
+
+            int tag = get_le16 (fmt);
+
+            /* the real format is in the first two bytes of the sub-format */
+            if (tag == WAVE_FORMAT_EXTENSIBLE && size >= 40)
+                tag = get_le16 (fmt + 24);
+
+            in->rate = get_le32 (fmt + 4);
+
+            if (! set_format (in, tag, get_le16 (fmt + 14), get_le16 (fmt + 2)))
+                return false;
+
+            have_format = true;
+        }
+        else if (! memcmp (chunk, "data", 4))
+        {
+            if (! have_format)
+                return false;
+
+            in->data_start = in->pos;
+
+            /* streamed WAV files often give a size of 0 or 0xFFFFFFFF */
+            if (size > 0 && size < 0xFFFFFFFF)
+                in->data_end = in->pos + size;
+
+            return true;
+        }
+        else if (! in_skip (in, size + (size & 1)))
+            return false;
+    }
+
+    return false;
+}
+
+static bool parse_header (InputFile * in)
+{
+    const uint8_t * head = in->map;
+    long head_len = in->map_size;
+
+    if (! in->map)
+    {
+        in->head_len = fread (in->head, 1, sizeof in->head, in->file);
+        head = in->head;
+        head_len = in->head_len;
+    }
+
+    /* without a RIFF header, the whole file is raw samples */
+    if (head_len < 12 || memcmp (head, "RIFF", 4))
+        return set_format (in, WAVE_FORMAT_PCM, 16, 1);
+
+    if (memcmp (head + 8, "WAVE", 4))
+        return false;
+
+    in->pos = 12;
+    in->head_pos = in->head_len;
+
+    return parse_wav (in);
+}
+
+/* The input is read in steps of step_samples samples. */
+
+InputFile * input_open (const char * name, int step_samples)
+{
+    InputFile * in = calloc (1, sizeof (InputFile));
+    if (! in)
+        return NULL;
+
+    in->data_end = -1;
+    in->step_samples = step_samples;
+
+    bool use_stdin = ! strcmp (name, "-");
+    in->file = use_stdin ? stdin : fopen (name, "rb");
+    if (! in->file)
+        goto ERR_FREE;
+
+    struct stat st;
+
+    if (! fstat (fileno (in->file), & st) && S_ISREG (st.st_mode) && st.st_size > 0)
+    {
+        void * map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (in->file), 0);
+
+        if (map != MAP_FAILED)
+        {
+            in->map = map;
+            in->map_size = st.st_size;
+            madvise (map, st.st_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (! parse_header (in))
+        goto ERR_CLOSE;
+
+    if (in->map && (in->data_end < 0 || in->data_end > in->map_size))
+        in->data_end = in->map_size;
+
+    if (! in->map && ! (in->buf = malloc (step_samples * in->frame_bytes)))
+        goto ERR_CLOSE;
+
+    return in;
+
+ERR_CLOSE:
+    if (in->map)
+        munmap (in->map, in->map_size);
+    if (! use_stdin)
+        fclose (in->file);
+ERR_FREE:
+    free (in);
+    return NULL;
+}
+
+void input_close (InputFile * in)
+{
+    if (in->map)
+        munmap (in->map, in->map_size);
+    if (in->file != stdin)
+        fclose (in->file);
+
+    free (in->buf);
+    free (in);
+}
+
+/* Returns the sample rate given in the WAV header, or 0 for raw input. */
+
+int input_rate (InputFile * in)
+{
+    return in->rate;
+}
+
+/* Returns the number of whole steps in the input, or -1 in streaming mode,
+ * where the input cannot be read more than once. */
+
+long input_n_steps (InputFile * in)
+{
+    if (! in->map)
+        return -1;
+
+    return (in->data_end - in->data_start) / ((long) in->step_samples * in->frame_bytes);
+}
+
+/* Seeking is possible only in mapped mode. */
+
+bool input_seek_step (InputFile * in, long step)
+{
+    long pos = in->data_start + step * in->step_samples * in->frame_bytes;
+
+    if (! in->map || step < 0 || pos > in->data_end)
+        return false;
+
+    in->pos = pos;
+    return true;
+}
+
+/* The conversion loops are kept simple so that they can be vectorized.  The
+ * mono case is handled separately, since it is by far the most common. */
+
+#define CONVERT(type, load, scale) \
+    if (channels == 1) \
+    { \
+        for (int i = 0; i < n; i ++) \
+        { \
+            const uint8_t * p = src + i * (int) sizeof (type); \
+            data[i] = (load) / (scale); \
+        } \
+    } \
+    else \
+    { \
+        for (int i = 0; i < n; i ++) \
+        { \
+            float sum = 0; \
+            for (int c = 0; c < channels; c ++) \
+            { \
+                const uint8_t * p = src + (i * channels + c) * (int) sizeof (type); \
+                sum += (load); \
+            } \
+            data[i] = sum / ((scale) * channels); \
+        } \
+    }
+
+typedef struct { uint8_t b[3]; } s24;
+
+static float load_s16 (const uint8_t * p)
+{
+    int16_t v;
+    memcpy (& v, p, 2);
+    return v;
+}
+
+static float load_s24 (const uint8_t * p)
+{
+    /* shift into the top of a 32-bit value to extend the sign */
+    return (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+}
+
+static float load_s32 (const uint8_t * p)
+{
+    int32_t v;
+    memcpy (& v, p, 4);
+    return v;
+}
+
+static float load_float (const uint8_t * p)
+{
+    float v;
+    memcpy (& v, p, 4);
+    return v;
+}
+
+static void convert_step (const InputFile * in, const uint8_t * src,
+ float data[])
+{
+    int n = in->step_samples;
+    int channels = in->channels;
+
+    switch (in->format)
+    {
+    case FORMAT_U8:
+        CONVERT (uint8_t, * p - 128, 127.0f)
+        break;
+    case FORMAT_S16:
+        CONVERT (int16_t, load_s16 (p), 32767.0f)
+        break;
+    case FORMAT_S24:
+        CONVERT (s24, load_s24 (p), 8388607.0f)
+        break;
+    case FORMAT_S32:
+        CONVERT (int32_t, load_s32 (p), 2147483647.0f)
+        break;
+    case FORMAT_FLOAT:
+        CONVERT (float, load_float (p), 1.0f)
+        break;
+    }
+}
+
+bool input_read_step (InputFile * in, float data[])
+{
+    long len = (long) in->step_samples * in->frame_bytes;
+
+    if (in->data_end >= 0 && in->pos + len > in->data_end)
+        return false;
+
+    if (in->map)
+    {
+        convert_step (in, in->map + in->pos, data);
+        in->pos += len;
+        return true;
+    }
+
+    if (! in_read (in, in->buf, len))
+        return false;
+
+    convert_step (in, in->buf, data);
+    return true;
+}
@@ -17,19 +17,75 @@
  * the use of this software.
  */
 
+/*
+ * Capture runs in its own thread, which hands the samples to the analysis
+ * thread through a single-producer, single-consumer queue of steps.  Each
+ * index into the queue is written by only one side, so no lock is needed.  A
+ * semaphore, posted once for each step queued, lets the analysis thread sleep
+ * while the queue is empty.
+ *
+ * If the queue is full, the capture thread keeps reading so that the device
+ * does not overrun, but the samples are dropped.  If the analysis thread falls
+ * behind, it takes all of the steps queued and analyzes only the last.
+ */
+
 #include "jtuner.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <alsa/asoundlib.h>
 
+/* In low-latency mode, the buffer holds this many periods, but at least two
+ * steps. */
+#define LOW_LATENCY_PERIODS 4
+
+/* about 1.5 seconds with the default step size */
+#define QUEUE_STEPS 32
+
+/* With mmap, the capture thread waits this long for samples at a time.  If
+ * none come after STALL_WAITS waits, the device is taken to have stalled (as
+ * after a suspend or a USB hiccup), and the stream is restarted. */
+#define WAIT_MS 1000
+#define STALL_WAITS 3
+
 static snd_pcm_t * handle;
+static int channels;
+static int step_samples;
+static bool use_mmap;
+
+/* used only without mmap */
+static int16_t * ibuf;
+static snd_pcm_channel_area_t ibuf_areas[MAX_CHANNELS];
+
+/* QUEUE_STEPS steps, plus one where dropped steps are read.  In each step, the
+ * channels follow one another. */
+static float * queue;
+static unsigned queue_head;     /* written only by the capture thread */
+static unsigned queue_tail;     /* written only by the analysis thread */
+static sem_t queue_sem;
 
-bool io_init (void)
+static pthread_t capture_thread;
+static bool capture_stop;
+
+static void * capture_worker (void * arg);
+
+/* If period_frames is nonzero, small periods of about that many frames are
+ * requested, and the capture buffer is accessed directly with mmap if the
+ * device allows it.  Otherwise the ALSA defaults are used.  If realtime is
+ * true, the capture thread is given SCHED_FIFO priority, if permitted. */
+
+bool io_init (const char * device, const JTunerConfig * cfg, int n_channels,
+ int period_frames, bool realtime)
 {
-    if (snd_pcm_open (& handle, "default", SND_PCM_STREAM_CAPTURE, 0) < 0)
+    if (snd_pcm_open (& handle, device, SND_PCM_STREAM_CAPTURE, 0) < 0)
         return false;
 
     snd_pcm_hw_params_t * params;
@@ -38,62 +94,358 @@ bool io_init (void)
     if (snd_pcm_hw_params_any (handle, params) < 0)
         goto ERR_CLOSE;
 
-    if (snd_pcm_hw_params_set_access (handle, params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+    use_mmap = (period_frames > 0 && snd_pcm_hw_params_set_access (handle,
+     params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+
+    if (! use_mmap && snd_pcm_hw_params_set_access (handle, params,
+     SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
         goto ERR_CLOSE;
 
     if (snd_pcm_hw_params_set_format (handle, params, SND_PCM_FORMAT_S16) < 0)
         goto ERR_CLOSE;
 
-    if (snd_pcm_hw_params_set_channels (handle, params, 1) < 0)
+    if (snd_pcm_hw_params_set_channels (handle, params, n_channels) < 0)
         goto ERR_CLOSE;
 
-    if (snd_pcm_hw_params_set_rate (handle, params, SAMPLERATE, 0) < 0)
+    if (snd_pcm_hw_params_set_rate (handle, params, cfg->rate, 0) < 0)
         goto ERR_CLOSE;
 
+    if (period_frames > 0)
+    {
+        snd_pcm_uframes_t period = period_frames;
+        snd_pcm_uframes_t buffer = LOW_LATENCY_PERIODS * period_frames;
+
+        if (buffer < 2 * (snd_pcm_uframes_t) cfg->step_samples)
+            buffer = 2 * cfg->step_samples;
+
+        if (snd_pcm_hw_params_set_period_size_near (handle, params, & period, NULL) < 0)
+            goto ERR_CLOSE;
+
+        if (snd_pcm_hw_params_set_buffer_size_near (handle, params, & buffer) < 0)
+            goto ERR_CLOSE;
+    }
+
     if (snd_pcm_hw_params (handle, params) < 0)
         goto ERR_CLOSE;
 
+    channels = n_channels;
+    step_samples = cfg->step_samples;
+
+    if (! (queue = malloc ((QUEUE_STEPS + 1) * step_samples * channels * sizeof (float))))
+        goto ERR_CLOSE;
+
+    if (use_mmap)
+    {
+        /* unlike snd_pcm_readi, mmap access does not start capture */
+        if (snd_pcm_start (handle) < 0)
+            goto ERR_FREE;
+    }
+    else
+    {
+        if (! (ibuf = malloc (step_samples * channels * sizeof (int16_t))))
+            goto ERR_FREE;
+
+        /* the read buffer is described the same way as the mmap areas */
+        for (int c = 0; c < channels; c ++)
+        {
+            ibuf_areas[c].addr = ibuf;
+            ibuf_areas[c].first = c * 16;
+            ibuf_areas[c].step = channels * 16;
+        }
+    }
+
+    queue_head = queue_tail = 0;
+    capture_stop = false;
+    sem_init (& queue_sem, 0, 0);
+
+    pthread_attr_t attr;
+    pthread_attr_init (& attr);
+
+    if (realtime)
+    {
+        struct sched_param param = {.sched_priority = sched_get_priority_min (SCHED_FIFO)};
+
+        pthread_attr_setinheritsched (& attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy (& attr, SCHED_FIFO);
+        pthread_attr_setschedparam (& attr, & param);
+    }
+
+    int err = pthread_create (& capture_thread, & attr, capture_worker, NULL);
+
+    /* without permission for realtime scheduling, run at normal priority */
+    if (err == EPERM)
+    {
+        fprintf (stderr, "realtime scheduling not permitted\n");
+        err = pthread_create (& capture_thread, NULL, capture_worker, NULL);
+    }
+
+    pthread_attr_destroy (& attr);
+
+    if (err)
+    {
+        sem_destroy (& queue_sem);
+        goto ERR_FREE;
+    }
+
     return true;
 
+ERR_FREE:
+    free (ibuf);
+    free (queue);
+    ibuf = NULL;
+    queue = NULL;
 ERR_CLOSE:
     snd_pcm_close (handle);
     return false;
 }
 
-static bool io_read_step (float data[SAMPLES_PER_STEP])
+/* The interleaved frames are split up into channels as they are converted,
+ * starting at pos within the step.  The position of each channel is given by
+ * an ALSA channel area, in bits. */
+
+static void convert_frames (const snd_pcm_channel_area_t * areas,
+ snd_pcm_uframes_t offset, int frames, float * step, int pos)
+{
+    for (int c = 0; c < channels; c ++)
+    {
+        const uint8_t * src = (const uint8_t *) areas[c].addr +
+         (areas[c].first + offset * areas[c].step) / 8;
+        int stride = areas[c].step / 8;
+
+        float * data = step + c * step_samples + pos;
+
+        for (int i = 0; i < frames; i ++)
+            data[i] = * (const int16_t *) (src + i * stride) / 32767.0f;
+    }
+}
+
+/* These return the number of frames read, or a negative error code. */
+
+static snd_pcm_sframes_t read_frames (float * step, int pos, int frames)
+{
+    uint64_t start = trace_start ();
+    snd_pcm_sframes_t got = snd_pcm_readi (handle, ibuf, frames);
+    trace_end (TRACE_CAPTURE, start);
+
+    if (got > 0)
+    {
+        start = trace_start ();
+        convert_frames (ibuf_areas, 0, got, step, pos);
+        trace_end (TRACE_CONVERT, start);
+    }
+
+    return got;
+}
+
+static snd_pcm_sframes_t read_frames_mmap (float * step, int pos, int frames)
+{
+    static int n_waits;     /* waits in a row without samples */
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update (handle);
+    if (avail < 0)
+        return avail;
+
+    if (avail == 0)
+    {
+        uint64_t start = trace_start ();
+        int ready = snd_pcm_wait (handle, WAIT_MS);
+        trace_end (TRACE_CAPTURE, start);
+
+        if (ready < 0)
+            return ready;
+
+        if (ready == 0 && ++ n_waits >= STALL_WAITS)
+        {
+            n_waits = 0;
+            return -EIO;
+        }
+
+        return 0;
+    }
+
+    n_waits = 0;
+
+    const snd_pcm_channel_area_t * areas;
+    snd_pcm_uframes_t offset, n = (avail < frames) ? avail : frames;
+
+    int err = snd_pcm_mmap_begin (handle, & areas, & offset, & n);
+    if (err < 0)
+        return err;
+
+    uint64_t start = trace_start ();
+    convert_frames (areas, offset, n, step, pos);
+    trace_end (TRACE_CONVERT, start);
+
+    snd_pcm_sframes_t done = snd_pcm_mmap_commit (handle, offset, n);
+    if (done >= 0 && (snd_pcm_uframes_t) done != n)
+        return -EPIPE;
+
+    return done;
+}
+
+/* After an overrun, the samples lost are simply skipped.  The ring buffers
+ * still hold valid windows, just not contiguous ones, so the tuner recovers
+ * within a window.  A stalled device (-EIO) is restarted, which
+ * snd_pcm_recover does not do; only if that fails is the error fatal. */
+
+static bool recover (int err)
 {
-    int16_t ibuf[SAMPLES_PER_STEP];
+    fprintf (stderr, "audio read error (%s), recovering\n", snd_strerror (err));
+    trace_end (TRACE_XRUN, trace_start ());
 
-    if (snd_pcm_readi (handle, ibuf, SAMPLES_PER_STEP) != SAMPLES_PER_STEP)
+    if (err == -EIO)
+    {
+        snd_pcm_drop (handle);
+
+        if (snd_pcm_prepare (handle) < 0)
+            return false;
+    }
+    else if (snd_pcm_recover (handle, err, 1) < 0)
         return false;
 
-    for (int i = 0; i < SAMPLES_PER_STEP; i ++)
-        data[i] = ibuf[i] / 32767.0f;
+    return ! use_mmap || snd_pcm_start (handle) == 0;
+}
+
+static bool capture_step (float * step)
+{
+    int pos = 0;
+
+    while (pos < step_samples)
+    {
+        snd_pcm_sframes_t got = use_mmap ?
+         read_frames_mmap (step, pos, step_samples - pos) :
+         read_frames (step, pos, step_samples - pos);
+
+        if (got < 0 && ! recover (got))
+            return false;
+
+        if (got > 0)
+            pos += got;
+    }
 
     return true;
 }
 
-bool io_read_samples (float data[N_SAMPLES])
+/* On error, the semaphore is posted with the queue empty, which the analysis
+ * thread takes as the end of the samples. */
+
+static void * capture_worker (void * arg)
 {
-    static bool filled = false;
+    long n_dropped = 0;
 
-    if (filled)
-        memmove (data, data + SAMPLES_PER_STEP, (N_STEPS - 1) * SAMPLES_PER_STEP * sizeof data[0]);
-    else
+    trace_set_thread ("capture");
+
+    while (! __atomic_load_n (& capture_stop, __ATOMIC_ACQUIRE))
     {
-        for (int i = 0; i < N_STEPS - 1; i ++)
+        unsigned head = queue_head;
+        unsigned tail = __atomic_load_n (& queue_tail, __ATOMIC_ACQUIRE);
+        bool full = (head - tail == QUEUE_STEPS);
+
+        int slot = full ? QUEUE_STEPS : head % QUEUE_STEPS;
+
+        if (! capture_step (queue + slot * step_samples * channels))
         {
-            if (! io_read_step (data + i * SAMPLES_PER_STEP))
-                return false;
+            sem_post (& queue_sem);
+            break;
         }
 
-        filled = true;
+        if (full)
+        {
+            trace_end (TRACE_DROP, trace_start ());
+
+            if (! (n_dropped ++))
+                fprintf (stderr, "analysis too slow, dropping samples\n");
+
+            continue;
+        }
+
+        __atomic_store_n (& queue_head, head + 1, __ATOMIC_RELEASE);
+        sem_post (& queue_sem);
     }
 
-    return io_read_step (data + (N_STEPS - 1) * SAMPLES_PER_STEP);
+    return NULL;
+}
+
+/* Moves one step from the queue into the contexts, waiting for it if wait is
+ * true.  Returns false if there was none. */
+
+static bool queue_pop (JTunerContext * ctx[], bool wait, bool * filled)
+{
+    if (wait)
+    {
+        uint64_t start = trace_start ();
+
+        while (sem_wait (& queue_sem) < 0 && errno == EINTR)
+            ;
+
+        trace_end (TRACE_QUEUE_WAIT, start);
+    }
+    else if (sem_trywait (& queue_sem) < 0)
+        return false;
+
+    unsigned tail = queue_tail;
+
+    if (tail == __atomic_load_n (& queue_head, __ATOMIC_ACQUIRE))
+    {
+        /* the capture thread has failed; leave the post for the next call */
+        sem_post (& queue_sem);
+        return false;
+    }
+
+    const float * step = queue + (tail % QUEUE_STEPS) * step_samples * channels;
+
+    * filled = true;
+
+    for (int c = 0; c < channels; c ++)
+    {
+        memcpy (context_next_step (ctx[c]), step + c * step_samples,
+         step_samples * sizeof (float));
+        * filled = context_push_step (ctx[c]) && * filled;
+    }
+
+    __atomic_store_n (& queue_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Takes one step, or more until the window in each context has been filled.
+ * If more steps are already queued, they are taken too, so that only the
+ * latest window is analyzed.  There is one context for each channel. */
+
+bool io_read_samples (JTunerContext * ctx[])
+{
+    bool filled = false;
+    int n_steps = 0;
+
+    while (! filled)
+    {
+        if (! queue_pop (ctx, true, & filled))
+            return false;
+
+        n_steps ++;
+    }
+
+    while (queue_pop (ctx, false, & filled))
+        n_steps ++;
+
+    if (n_steps > 1)
+    {
+        for (int c = 0; c < channels; c ++)
+            context_skip_steps (ctx[c]);
+    }
+
+    return true;
 }
 
 void io_cleanup (void)
 {
+    __atomic_store_n (& capture_stop, true, __ATOMIC_RELEASE);
+    pthread_join (capture_thread, NULL);
+
+    sem_destroy (& queue_sem);
     snd_pcm_close (handle);
+
+    free (ibuf);
+    free (queue);
+    ibuf = NULL;
+    queue = NULL;
 }
@@ -0,0 +1,565 @@
+/*
+ * JTuner - jtuner-bench.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Microbenchmarks of each stage of the analysis.  Each stage is run over a set
+ * of frames, either of synthetic piano-like tones (with stretched harmonics)
+ * or of a recording given with -i.  A benchmark is first calibrated so that
+ * one repetition takes at least the given time, run once more to warm up, and
+ * then repeated.  The median time per frame is reported, along with the
+ * spread of the repetitions (median absolute deviation, as a percentage).
+ *
+ * Cycles are counted with the time-stamp counter, which runs at a constant
+ * rate and so counts reference cycles rather than core cycles.
+ *
+ * The results can be written as CSV (-o) and compared against a file written
+ * earlier (-b).  With -x, the exit status is 2 if any benchmark is slower than
+ * the baseline by more than the given percentage.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* The peak search and tone analysis are internal to tone.c, so it is built as
+ * part of this file (instead of being linked) to benchmark them directly. */
+#include "tone.c"
+
+/* synthetic tones, from A0 to C8 in steps of a fifth */
+#define SYNTH_MIN_PITCH 9
+#define SYNTH_MAX_PITCH 96
+#define SYNTH_PITCH_STEP 7
+#define SYNTH_HARMONICS 12
+
+/* inharmonicity, as for a mid-range piano string */
+#define SYNTH_B 0.0004f
+
+#define OCTAVE_STRETCH 0.05f
+
+#define MIN_FREQ_HZ 20
+#define MAX_FREQ_HZ 10000
+
+/* frames taken from a recording */
+#define FIXTURE_FRAMES 16
+#define MAX_FIXTURE_STEPS 8192
+
+#define MAX_BENCH_RESULTS 32
+
+typedef struct {
+    const char * name;
+    void (* run) (int frame);
+    bool per_bin;           /* whether to report cycles per bin */
+} Bench;
+
+typedef struct {
+    char name[32];
+    double ns_per_frame;
+    double frames_per_sec;
+    double cycles_per_bin;  /* 0 if not measured */
+    double spread_pct;
+} BenchResult;
+
+static int rate = SAMPLERATE;
+static int window_size = N_SAMPLES;
+static int hop_size = SAMPLES_PER_STEP;
+static int n_levels = MAX_LEVELS;
+static int n_reps = 10;
+static int rep_ms = 50;
+
+static JTunerConfig cfg;
+
+/* the samples, as a stream of steps */
+static float * stream;
+static int stream_steps;
+
+/* one context for each frame, with its window filled */
+static int n_frames;
+static JTunerContext * * frame_ctx;
+static float * * frame_freqs;
+static Peak (* frame_peaks)[N_PEAKS];
+static float * frame_tone_hz;
+
+/* contexts fed one step of the stream at a time */
+static JTunerContext * slide_ctx, * multi_ctx;
+static int slide_pos, multi_pos;
+
+static float * freqs;
+
+/* results are summed here, so that no work can be optimized out */
+static volatile float sink;
+
+static void error_exit (const char * error)
+{
+    fprintf (stderr, "%s\n", error);
+    exit (1);
+}
+
+static void * alloc (size_t size)
+{
+    void * mem = malloc (size);
+    if (! mem)
+        error_exit ("out of memory");
+
+    return mem;
+}
+
+/* a simple generator, so that the signals are the same on every run */
+static float noise (unsigned * seed)
+{
+    * seed = * seed * 1103515245 + 12345;
+    return (float) (* seed >> 8) / (1 << 24) - 0.5f;
+}
+
+/* Each tone lasts two windows, so that the first window of each frame is
+ * filled by one tone only. */
+
+static void make_synth (void)
+{
+    int n_tones = (SYNTH_MAX_PITCH - SYNTH_MIN_PITCH) / SYNTH_PITCH_STEP + 1;
+    int tone_steps = 2 * cfg.n_steps;
+    int tone_len = tone_steps * cfg.step_samples;
+
+    stream_steps = n_tones * tone_steps;
+    stream = alloc ((size_t) stream_steps * cfg.step_samples * sizeof (float));
+
+    unsigned seed = 1;
+
+    for (int t = 0; t < n_tones; t ++)
+    {
+        float f0 = pitch_to_tone_hz (OCTAVE_STRETCH, SYNTH_MIN_PITCH + t * SYNTH_PITCH_STEP);
+        float * out = stream + (size_t) t * tone_len;
+
+        for (int i = 0; i < tone_len; i ++)
+            out[i] = 0.001f * noise (& seed);
+
+        for (int k = 1; k <= SYNTH_HARMONICS; k ++)
+        {
+            float fk = k * f0 * sqrtf (1 + SYNTH_B * k * k);
+            if (fk >= cfg.rate / 2)
+                break;
+
+            float phase = 2 * (float) M_PI * noise (& seed);
+            float w = 2 * (float) M_PI * fk / cfg.rate;
+
+            for (int i = 0; i < tone_len; i ++)
+                out[i] += (0.3f / k) * sinf (w * i + phase);
+        }
+    }
+
+    n_frames = n_tones;
+}
+
+static void load_fixture (const char * name)
+{
+    InputFile * in = input_open (name, cfg.step_samples);
+    if (! in)
+        error_exit ("error opening input file");
+
+    if (input_rate (in) && ! config_set (& cfg, input_rate (in), window_size, hop_size))
+        error_exit ("unsupported sample rate");
+
+    stream = alloc ((size_t) MAX_FIXTURE_STEPS * cfg.step_samples * sizeof (float));
+
+    while (stream_steps < MAX_FIXTURE_STEPS &&
+     input_read_step (in, stream + (size_t) stream_steps * cfg.step_samples))
+        stream_steps ++;
+
+    input_close (in);
+
+    if (stream_steps < 2 * cfg.n_steps)
+        error_exit ("input file too short");
+
+    n_frames = FIXTURE_FRAMES;
+}
+
+/* Pushes the next step of the stream, wrapping around at the end. */
+
+static bool push_stream_step (JTunerContext * ctx, int * pos)
+{
+    memcpy (context_next_step (ctx), stream + (size_t) * pos * cfg.step_samples,
+     cfg.step_samples * sizeof (float));
+
+    * pos = (* pos + 1) % stream_steps;
+
+    return context_push_step (ctx);
+}
+
+static void setup (void)
+{
+    frame_ctx = alloc (n_frames * sizeof (JTunerContext *));
+    frame_freqs = alloc (n_frames * sizeof (float *));
+    frame_peaks = alloc (n_frames * sizeof * frame_peaks);
+    frame_tone_hz = alloc (n_frames * sizeof (float));
+    freqs = alloc (cfg.n_freqs * sizeof (float));
+
+    for (int f = 0; f < n_frames; f ++)
+    {
+        if (! (frame_ctx[f] = context_new (& cfg)))
+            error_exit ("out of memory");
+
+        int pos = (int) ((long) f * stream_steps / n_frames);
+
+        while (! push_stream_step (frame_ctx[f], & pos))
+            ;
+
+        frame_freqs[f] = alloc (cfg.n_freqs * sizeof (float));
+        fft_run (frame_ctx[f], frame_freqs[f]);
+
+        find_peaks (& cfg, frame_freqs[f], 1, cfg.n_freqs - 2, N_PEAKS, frame_peaks[f]);
+        frame_tone_hz[f] = tone_detect (frame_ctx[f], frame_freqs[f],
+         MIN_FREQ_HZ, MAX_FREQ_HZ, false).tone_hz;
+    }
+
+    if (! (slide_ctx = context_new (& cfg)) ||
+     ! (multi_ctx = context_new_multi (& cfg, n_levels)))
+        error_exit ("out of memory");
+
+    while (! push_stream_step (slide_ctx, & slide_pos))
+        ;
+    while (! push_stream_step (multi_ctx, & multi_pos))
+        ;
+}
+
+static void run_fft_run (int frame)
+{
+    fft_run (frame_ctx[frame % n_frames], freqs);
+    sink += freqs[1];
+}
+
+static void run_fft_slide (int frame)
+{
+    push_stream_step (slide_ctx, & slide_pos);
+    fft_slide (slide_ctx, freqs, 0, cfg.n_freqs - 1);
+    sink += freqs[1];
+}
+
+static void run_find_peaks (int frame)
+{
+    Peak peaks[N_PEAKS];
+    find_peaks (& cfg, frame_freqs[frame % n_frames], 1, cfg.n_freqs - 2, N_PEAKS, peaks);
+    sink += peaks[0].freq_hz;
+}
+
+/* As in tone_detect, each peak is tried as the fundamental. */
+
+static void run_analyze_tone (int frame)
+{
+    const Peak * peaks = frame_peaks[frame % n_frames];
+
+    for (int p = 0; p < N_PEAKS; p ++)
+        sink += analyze_tone (peaks, peaks[p].freq_hz).harm_score;
+}
+
+static void run_tone_detect (int frame)
+{
+    int f = frame % n_frames;
+    sink += tone_detect (frame_ctx[f], frame_freqs[f], MIN_FREQ_HZ, MAX_FREQ_HZ,
+     false).tone_hz;
+}
+
+static void run_round_to_pitch (int frame)
+{
+    sink += round_to_pitch (OCTAVE_STRETCH, frame_tone_hz[frame % n_frames]).off_by;
+}
+
+/* Everything done for one step by jtuner, except capture */
+
+static void run_pipeline (int frame)
+{
+    push_stream_step (multi_ctx, & multi_pos);
+
+    DetectedTone tone = tone_detect_multi (multi_ctx, MIN_FREQ_HZ, MAX_FREQ_HZ, false);
+    DetectedPitch pitch = pitch_identify (multi_ctx, OCTAVE_STRETCH, tone.tone_hz);
+    Intervals iv = identify_intervals (OCTAVE_STRETCH, pitch.pitch, tone.overtones_hz);
+
+    sink += pitch.off_by + iv.n_intervals;
+}
+
+static const Bench benches[] = {
+    {"fft_run", run_fft_run, true},
+    {"fft_slide", run_fft_slide, true},
+    {"find_peaks", run_find_peaks, true},
+    {"analyze_tone", run_analyze_tone, false},
+    {"tone_detect", run_tone_detect, true},
+    {"round_to_pitch", run_round_to_pitch, false},
+    {"pipeline", run_pipeline, true}
+};
+
+#define N_BENCHES (int) (sizeof benches / sizeof benches[0])
+
+static double now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long read_cycles (void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+static int compare_double (const void * a, const void * b)
+{
+    double x = * (const double *) a, y = * (const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double median (double vals[], int n)
+{
+    qsort (vals, n, sizeof (double), compare_double);
+    return (n % 2) ? vals[n / 2] : (vals[n / 2 - 1] + vals[n / 2]) / 2;
+}
+
+static void run_bench (const Bench * b, BenchResult * r)
+{
+    /* calibrate, doubling the number of frames until the time is long enough */
+    long n = 1;
+
+    while (true)
+    {
+        double start = now_ns ();
+
+        for (long i = 0; i < n; i ++)
+            b->run (i);
+
+        if (now_ns () - start >= rep_ms * 1e6)
+            break;
+
+        n *= 2;
+    }
+
+    /* warm up */
+    for (long i = 0; i < n; i ++)
+        b->run (i);
+
+    double ns[n_reps], cycles[n_reps], dev[n_reps];
+
+    for (int rep = 0; rep < n_reps; rep ++)
+    {
+        double start = now_ns ();
+        unsigned long long start_cycles = read_cycles ();
+
+        for (long i = 0; i < n; i ++)
+            b->run (i);
+
+        cycles[rep] = (double) (read_cycles () - start_cycles) / n;
+        ns[rep] = (now_ns () - start) / n;
+    }
+
+    double med = median (ns, n_reps);
+
+    for (int rep = 0; rep < n_reps; rep ++)
+        dev[rep] = fabs (ns[rep] - med);
+
+    snprintf (r->name, sizeof r->name, "%s", b->name);
+    r->ns_per_frame = med;
+    r->frames_per_sec = 1e9 / med;
+    r->cycles_per_bin = b->per_bin ? median (cycles, n_reps) / cfg.n_freqs : 0;
+    r->spread_pct = 100 * median (dev, n_reps) / med;
+}
+
+static int load_baseline (const char * name, BenchResult base[])
+{
+    FILE * file = fopen (name, "r");
+    if (! file)
+        error_exit ("error opening baseline file");
+
+    char line[256];
+    int n = 0;
+
+    while (n < MAX_BENCH_RESULTS && fgets (line, sizeof line, file))
+    {
+        BenchResult * r = & base[n];
+
+        if (sscanf (line, "%31[^,],%lf,%lf,%lf,%lf", r->name, & r->ns_per_frame,
+         & r->frames_per_sec, & r->cycles_per_bin, & r->spread_pct) == 5)
+            n ++;
+    }
+
+    fclose (file);
+    return n;
+}
+
+static const BenchResult * find_result (const BenchResult results[], int n,
+ const char * name)
+{
+    for (int i = 0; i < n; i ++)
+    {
+        if (! strcmp (results[i].name, name))
+            return & results[i];
+    }
+
+    return NULL;
+}
+
+static bool is_selected (const char * name, int n_names, char * * names)
+{
+    if (! n_names)
+        return true;
+
+    for (int i = 0; i < n_names; i ++)
+    {
+        if (! strcmp (names[i], name))
+            return true;
+    }
+
+    return false;
+}
+
+static const char usage[] =
+ "Usage: jtuner-bench [options] [benchmark ...]\n"
+ "Options: [-i recording.raw|wav] [-m levels] [-r rate (synthetic or raw)]\n"
+ "         [-w window] [-H hop] [-n repetitions] [-t ms per repetition]\n"
+ "         [-o results.csv] [-b baseline.csv] [-x max slowdown %]\n"
+ "Benchmarks: fft_run fft_slide find_peaks analyze_tone tone_detect\n"
+ "            round_to_pitch pipeline";
+
+int main (int argc, char * * argv)
+{
+    const char * fixture_name = NULL, * out_name = NULL, * base_name = NULL;
+    float max_slowdown = -1;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "b:i:m:n:o:r:t:w:x:H:")) != -1)
+    {
+        if (opt == 'b')
+            base_name = optarg;
+        else if (opt == 'i')
+            fixture_name = optarg;
+        else if (opt == 'm')
+            n_levels = atoi (optarg);
+        else if (opt == 'n')
+            n_reps = atoi (optarg);
+        else if (opt == 'o')
+            out_name = optarg;
+        else if (opt == 'r')
+            rate = atoi (optarg);
+        else if (opt == 't')
+            rep_ms = atoi (optarg);
+        else if (opt == 'w')
+            window_size = atoi (optarg);
+        else if (opt == 'x')
+            max_slowdown = atof (optarg);
+        else if (opt == 'H')
+            hop_size = atoi (optarg);
+        else
+            error_exit (usage);
+    }
+
+    for (int i = optind; i < argc; i ++)
+    {
+        bool known = false;
+
+        for (int b = 0; b < N_BENCHES; b ++)
+            known = known || ! strcmp (argv[i], benches[b].name);
+
+        if (! known)
+            error_exit (usage);
+    }
+
+    if (n_levels < 1 || n_levels > MAX_LEVELS)
+        error_exit ("number of window sizes must be 1 to 4");
+    if (n_reps < 1 || rep_ms < 1)
+        error_exit ("repetitions and time per repetition must be positive");
+    if (! config_set (& cfg, rate, window_size, hop_size))
+        error_exit ("invalid sample rate, window size, or hop size");
+
+    if (fixture_name)
+        load_fixture (fixture_name);
+    else
+        make_synth ();
+
+    setup ();
+
+    BenchResult base[MAX_BENCH_RESULTS];
+    int n_base = base_name ? load_baseline (base_name, base) : 0;
+
+    BenchResult results[N_BENCHES];
+    int n_results = 0;
+    bool regressed = false;
+
+    printf ("%d Hz, %d-sample window, %d-sample hop, %d frames of %s\n\n",
+     cfg.rate, cfg.n_samples, cfg.step_samples, n_frames,
+     fixture_name ? fixture_name : "synthetic tones");
+    printf ("%-16s %12s %12s %11s %8s%s\n", "benchmark", "ns/frame",
+     "frames/s", "cycles/bin", "spread", base_name ? "  vs baseline" : "");
+
+    for (int b = 0; b < N_BENCHES; b ++)
+    {
+        if (! is_selected (benches[b].name, argc - optind, argv + optind))
+            continue;
+
+        BenchResult * r = & results[n_results ++];
+        run_bench (& benches[b], r);
+
+        printf ("%-16s %12.1f %12.1f", r->name, r->ns_per_frame, r->frames_per_sec);
+
+        if (r->cycles_per_bin > 0)
+            printf (" %11.2f", r->cycles_per_bin);
+        else
+            printf (" %11s", "-");
+
+        printf (" %7.1f%%", r->spread_pct);
+
+        const BenchResult * old = find_result (base, n_base, r->name);
+
+        if (old)
+        {
+            float change = 100 * (r->ns_per_frame / old->ns_per_frame - 1);
+            printf ("  %+11.1f%%", change);
+
+            if (max_slowdown >= 0 && change > max_slowdown)
+                regressed = true;
+        }
+
+        printf ("\n");
+        fflush (stdout);
+    }
+
+    if (out_name)
+    {
+        FILE * out = fopen (out_name, "w");
+        if (! out)
+            error_exit ("error opening output file");
+
+        fprintf (out, "bench,ns_per_frame,frames_per_sec,cycles_per_bin,spread_pct\n");
+
+        for (int i = 0; i < n_results; i ++)
+            fprintf (out, "%s,%.1f,%.1f,%.3f,%.2f\n", results[i].name,
+             results[i].ns_per_frame, results[i].frames_per_sec,
+             results[i].cycles_per_bin, results[i].spread_pct);
+
+        fclose (out);
+    }
+
+    return regressed ? 2 : 0;
+}
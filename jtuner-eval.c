@@ -0,0 +1,505 @@
+/*
+ * JTuner - jtuner-eval.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Accuracy versus cost of the analysis, for a grid of window sizes, hop sizes,
+ * and numbers of window sizes (multi-resolution levels).
+ *
+ * The test signal is a sequence of synthetic notes, each of every pitch in the
+ * range (A0 to C8 by default) in a fixed, shuffled order, each detuned by a
+ * known amount and with inharmonic overtones, as of a string: the k-th
+ * partial is at k * f * sqrt(1 + B * k^2).  Since each note follows another,
+ * the latency includes the time for the last note to leave the window.
+ *
+ * For each setting, the signal is analyzed as by jtuner, and the following
+ * are reported:
+ *   - cpu: CPU time per second of signal
+ *   - found: notes whose pitch was shown at some point
+ *   - latency: median time from the start of a note until it was shown
+ *   - cents: median and 95th percentile error of the readings shown while the
+ *     right pitch was shown (compared with the first partial)
+ *   - wrong: readings showing some other pitch
+ *
+ * The settings are listed from cheapest to most expensive.  Those marked with
+ * '*' are Pareto-optimal: no other setting is at least as good in cpu, found,
+ * latency and 95th percentile error, and better in one of them.
+ *
+ * The number of peaks, the harmonic tolerance, and the interpolation of peaks
+ * are constants in tone.c.  To measure them, build with different values, for
+ * example:
+ *   make jtuner-eval EVAL_FLAGS="-DN_PEAKS=16 -DHARM_TOLERANCE=0.03f"
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* tone.c is built as part of this file, so that its constants can be set */
+#include "tone.c"
+
+#define OCTAVE_STRETCH 0.05f
+
+#define MIN_FREQ_HZ 20
+#define MAX_FREQ_HZ 10000
+
+#define MAX_GRID 8
+#define MAX_SETTINGS (MAX_GRID * MAX_GRID * MAX_GRID)
+
+#define SYNTH_HARMONICS 16
+#define MAX_DETUNE_CENTS 40
+
+typedef struct {
+    int n_samples, step_samples, n_levels;
+
+    float cpu_ms;           /* per second of signal */
+    float found_pct;
+    float latency_ms;
+    float cents_median, cents_p95;
+    float wrong_pct;
+    bool pareto;
+} Setting;
+
+static int rate = SAMPLERATE;
+static int min_pitch = 9;       /* A0 */
+static int max_pitch = 96;      /* C8 */
+static float inharmonicity = 0.0004f;
+static int note_ms = 1500;
+static bool band_limited;
+
+static int windows[MAX_GRID] = {8192, 16384, 32768};
+static int hops[MAX_GRID] = {512, 1024, 2048};
+static int levels[MAX_GRID] = {1, 4};
+static int n_windows = 3, n_hops = 3, n_levels = 2;
+
+/* the test signal */
+static float * signal;
+static int n_notes, note_len;
+static int * note_pitches;
+static float * note_true;       /* pitch of the first partial, in semitones */
+
+static Setting settings[MAX_SETTINGS];
+static int n_settings, next_setting;
+static pthread_mutex_t setting_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void error_exit (const char * error)
+{
+    fprintf (stderr, "%s\n", error);
+    exit (1);
+}
+
+static float noise (unsigned * seed)
+{
+    * seed = * seed * 1103515245 + 12345;
+    return (float) (* seed >> 8) / (1 << 24) - 0.5f;
+}
+
+static void make_signal (void)
+{
+    n_notes = max_pitch + 1 - min_pitch;
+    note_len = (int) ((long) note_ms * rate / 1000);
+
+    signal = malloc ((size_t) n_notes * note_len * sizeof (float));
+    note_pitches = malloc (n_notes * sizeof (int));
+    note_true = malloc (n_notes * sizeof (float));
+
+    if (! signal || ! note_pitches || ! note_true)
+        error_exit ("out of memory");
+
+    unsigned seed = 1;
+
+    for (int n = 0; n < n_notes; n ++)
+        note_pitches[n] = min_pitch + n;
+
+    /* shuffled, so that each note follows one at some distance */
+    for (int n = n_notes - 1; n > 0; n --)
+    {
+        int m = (int) ((noise (& seed) + 0.5f) * (n + 1)) % (n + 1);
+        int temp = note_pitches[n];
+        note_pitches[n] = note_pitches[m];
+        note_pitches[m] = temp;
+    }
+
+    for (int n = 0; n < n_notes; n ++)
+    {
+        float detune = 2 * noise (& seed) * MAX_DETUNE_CENTS / 100;
+        float f0 = pitch_to_tone_hz (OCTAVE_STRETCH, note_pitches[n] + detune);
+        float f1 = f0 * sqrtf (1 + inharmonicity);
+
+        RoundedPitch truth = round_to_pitch (OCTAVE_STRETCH, f1);
+        note_pitches[n] = truth.pitch;
+        note_true[n] = truth.pitch + truth.off_by;
+
+        float * out = signal + (size_t) n * note_len;
+
+        for (int i = 0; i < note_len; i ++)
+            out[i] = 0.001f * noise (& seed);
+
+        for (int k = 1; k <= SYNTH_HARMONICS; k ++)
+        {
+            float fk = k * f0 * sqrtf (1 + inharmonicity * k * k);
+            if (fk >= rate / 2)
+                break;
+
+            float phase = 2 * (float) M_PI * noise (& seed);
+            double w = 2 * M_PI * fk / rate;
+
+            for (int i = 0; i < note_len; i ++)
+                out[i] += (0.3f / k) * (float) sin (w * i + phase);
+        }
+    }
+}
+
+static int compare_float (const void * f1, const void * f2)
+{
+    float a = * (const float *) f1, b = * (const float *) f2;
+    return (a > b) - (a < b);
+}
+
+static float percentile (float vals[], int n, float pct)
+{
+    if (! n)
+        return NAN;
+
+    qsort (vals, n, sizeof (float), compare_float);
+    return vals[(int) (pct / 100 * (n - 1) + 0.5f)];
+}
+
+static double thread_cpu_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, & ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void evaluate (Setting * s)
+{
+    JTunerConfig cfg;
+    config_set (& cfg, rate, s->n_samples, s->step_samples);
+
+    JTunerContext * ctx = context_new_multi (& cfg, s->n_levels);
+    if (! ctx)
+        error_exit ("out of memory");
+
+    long total_len = (long) n_notes * note_len;
+    long n_steps = total_len / cfg.step_samples;
+
+    float * errors = malloc (n_steps * sizeof (float));
+    float * latencies = malloc (n_notes * sizeof (float));
+    int n_errors = 0, n_found = 0, n_shown = 0, n_wrong = 0;
+    int found_note = -1;
+
+    if (! errors || ! latencies)
+        error_exit ("out of memory");
+
+    double cpu_ms = 0;
+
+    for (long step = 0; step < n_steps; step ++)
+    {
+        long end = (step + 1) * cfg.step_samples;
+
+        double start = thread_cpu_ms ();
+
+        memcpy (context_next_step (ctx), signal + end - cfg.step_samples,
+         cfg.step_samples * sizeof (float));
+
+        if (! context_push_step (ctx))
+        {
+            cpu_ms += thread_cpu_ms () - start;
+            continue;
+        }
+
+        /* the band is an octave around the note, as with a target octave */
+        int note = (end - 1) / note_len;
+        float min_tone_hz = MIN_FREQ_HZ, max_tone_hz = MAX_FREQ_HZ;
+
+        if (band_limited)
+        {
+            min_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, note_pitches[note] - 6);
+            max_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, note_pitches[note] + 6);
+        }
+
+        DetectedTone tone = tone_detect_multi (ctx, min_tone_hz, max_tone_hz, band_limited);
+        DetectedPitch pitch = pitch_identify (ctx, OCTAVE_STRETCH, tone.tone_hz);
+
+        cpu_ms += thread_cpu_ms () - start;
+
+        if (pitch.state != DETECT_UPDATE)
+            continue;
+
+        n_shown ++;
+
+        if (pitch.pitch != note_pitches[note])
+        {
+            n_wrong ++;
+            continue;
+        }
+
+        errors[n_errors ++] = 100 * fabsf (pitch.pitch + pitch.off_by - note_true[note]);
+
+        if (found_note != note)
+        {
+            latencies[n_found ++] = (float) (end - (long) note * note_len) * 1000 / rate;
+            found_note = note;
+        }
+    }
+
+    s->cpu_ms = cpu_ms * rate / total_len;
+    s->found_pct = 100.0f * n_found / n_notes;
+    s->latency_ms = percentile (latencies, n_found, 50);
+    s->cents_median = percentile (errors, n_errors, 50);
+    s->cents_p95 = percentile (errors, n_errors, 95);
+    s->wrong_pct = n_shown ? 100.0f * n_wrong / n_shown : 0;
+
+    free (errors);
+    free (latencies);
+    context_free (ctx);
+}
+
+static void * eval_worker (void * unused)
+{
+    while (true)
+    {
+        pthread_mutex_lock (& setting_mutex);
+        int i = next_setting ++;
+        pthread_mutex_unlock (& setting_mutex);
+
+        if (i >= n_settings)
+            break;
+
+        evaluate (& settings[i]);
+    }
+
+    return NULL;
+}
+
+/* NaN (nothing found) compares as worst */
+
+static bool no_worse (float a, float b)
+{
+    return isnan (b) || (! isnan (a) && a <= b);
+}
+
+static bool dominates (const Setting * a, const Setting * b)
+{
+    bool no_worse_all = no_worse (a->cpu_ms, b->cpu_ms) &&
+     a->found_pct >= b->found_pct && no_worse (a->latency_ms, b->latency_ms) &&
+     no_worse (a->cents_p95, b->cents_p95);
+
+    bool better_one = a->cpu_ms < b->cpu_ms || a->found_pct > b->found_pct ||
+     ! no_worse (b->latency_ms, a->latency_ms) || ! no_worse (b->cents_p95, a->cents_p95);
+
+    return no_worse_all && better_one;
+}
+
+static void find_pareto (void)
+{
+    for (int i = 0; i < n_settings; i ++)
+    {
+        settings[i].pareto = true;
+
+        for (int j = 0; j < n_settings && settings[i].pareto; j ++)
+        {
+            if (j != i && dominates (& settings[j], & settings[i]))
+                settings[i].pareto = false;
+        }
+    }
+}
+
+static int compare_cost (const void * s1, const void * s2)
+{
+    const Setting * a = s1, * b = s2;
+    return (a->cpu_ms > b->cpu_ms) - (a->cpu_ms < b->cpu_ms);
+}
+
+static void write_table (FILE * out)
+{
+    fprintf (out, "%d Hz, pitches %d to %d, B = %g, %d ms notes%s\n",
+     rate, min_pitch, max_pitch, inharmonicity, note_ms,
+     band_limited ? ", band-limited" : "");
+    fprintf (out, "N_PEAKS = %d, HARM_TOLERANCE = %g, LOG_INTERPOLATION = %d\n\n",
+     N_PEAKS, HARM_TOLERANCE, LOG_INTERPOLATION);
+
+    fprintf (out, "%6s %5s %6s %9s %7s %11s %10s %10s %7s\n", "window", "hop",
+     "levels", "cpu ms/s", "found", "latency ms", "cents med", "cents p95", "wrong");
+
+    for (int i = 0; i < n_settings; i ++)
+    {
+        const Setting * s = & settings[i];
+
+        fprintf (out, "%6d %5d %6d %9.2f %6.1f%% %11.0f %10.2f %10.2f %6.1f%% %s\n",
+         s->n_samples, s->step_samples, s->n_levels, s->cpu_ms, s->found_pct,
+         s->latency_ms, s->cents_median, s->cents_p95, s->wrong_pct,
+         s->pareto ? "*" : "");
+    }
+}
+
+static void write_csv (FILE * out)
+{
+    fprintf (out, "window,hop,levels,cpu_ms_per_s,found_pct,latency_ms,"
+     "cents_median,cents_p95,wrong_pct,pareto\n");
+
+    for (int i = 0; i < n_settings; i ++)
+    {
+        const Setting * s = & settings[i];
+
+        fprintf (out, "%d,%d,%d,%.3f,%.1f,%.1f,%.3f,%.3f,%.2f,%d\n",
+         s->n_samples, s->step_samples, s->n_levels, s->cpu_ms, s->found_pct,
+         s->latency_ms, s->cents_median, s->cents_p95, s->wrong_pct, s->pareto);
+    }
+}
+
+/* Parses a comma-separated list of up to MAX_GRID values. */
+
+static int parse_list (const char * str, int vals[])
+{
+    int n = 0;
+
+    while (n < MAX_GRID)
+    {
+        char * end;
+        vals[n ++] = strtol (str, & end, 10);
+
+        if (* end != ',')
+            break;
+
+        str = end + 1;
+    }
+
+    return n;
+}
+
+static const char usage[] =
+ "Usage: jtuner-eval [-j jobs] [-o results.csv] [options]\n"
+ "Signal: [-r rate] [-p min_pitch-max_pitch] [-B inharmonicity] [-l note ms]\n"
+ "Grid: [-w windows] [-H hops] [-m levels] (comma-separated) [-b (band-limited)]";
+
+int main (int argc, char * * argv)
+{
+    const char * out_name = NULL;
+    int n_jobs = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "bj:l:m:o:p:r:w:B:H:")) != -1)
+    {
+        if (opt == 'b')
+            band_limited = true;
+        else if (opt == 'j')
+            n_jobs = atoi (optarg);
+        else if (opt == 'l')
+            note_ms = atoi (optarg);
+        else if (opt == 'm')
+            n_levels = parse_list (optarg, levels);
+        else if (opt == 'o')
+            out_name = optarg;
+        else if (opt == 'p')
+        {
+            if (sscanf (optarg, "%d-%d", & min_pitch, & max_pitch) != 2)
+                error_exit (usage);
+        }
+        else if (opt == 'r')
+            rate = atoi (optarg);
+        else if (opt == 'w')
+            n_windows = parse_list (optarg, windows);
+        else if (opt == 'B')
+            inharmonicity = atof (optarg);
+        else if (opt == 'H')
+            n_hops = parse_list (optarg, hops);
+        else
+            error_exit (usage);
+    }
+
+    if (optind < argc)
+        error_exit (usage);
+    if (min_pitch < 0 || max_pitch < min_pitch || max_pitch > 120)
+        error_exit ("pitch range must be within 0 to 120");
+    if (note_ms < 100 || inharmonicity < 0)
+        error_exit ("invalid note length or inharmonicity");
+
+    for (int w = 0; w < n_windows; w ++)
+    {
+        for (int h = 0; h < n_hops; h ++)
+        {
+            for (int l = 0; l < n_levels; l ++)
+            {
+                JTunerConfig cfg;
+
+                if (levels[l] < 1 || levels[l] > MAX_LEVELS)
+                    error_exit ("number of window sizes must be 1 to 4");
+
+                /* hops longer than the window are skipped */
+                if (! config_set (& cfg, rate, windows[w], hops[h]))
+                {
+                    if (config_set (& cfg, rate, windows[w], windows[w]) &&
+                     hops[h] > windows[w])
+                        continue;
+
+                    error_exit ("invalid sample rate, window size, or hop size");
+                }
+
+                Setting * s = & settings[n_settings ++];
+                s->n_samples = windows[w];
+                s->step_samples = hops[h];
+                s->n_levels = levels[l];
+            }
+        }
+    }
+
+    if (! n_settings)
+        error_exit ("no valid settings");
+
+    if (n_jobs < 1)
+        n_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n_jobs < 1)
+        n_jobs = 1;
+    if (n_jobs > n_settings)
+        n_jobs = n_settings;
+
+    make_signal ();
+
+    pthread_t threads[n_jobs];
+
+    for (int j = 0; j < n_jobs; j ++)
+    {
+        if (pthread_create (& threads[j], NULL, eval_worker, NULL))
+            error_exit ("error creating thread");
+    }
+    for (int j = 0; j < n_jobs; j ++)
+        pthread_join (threads[j], NULL);
+
+    find_pareto ();
+    qsort (settings, n_settings, sizeof (Setting), compare_cost);
+
+    write_table (stdout);
+
+    if (out_name)
+    {
+        FILE * out = fopen (out_name, "w");
+        if (! out)
+            error_exit ("error opening output file");
+
+        write_csv (out);
+        fclose (out);
+    }
+
+    return 0;
+}
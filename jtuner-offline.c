@@ -17,10 +17,14 @@
  * the use of this software.
  */
 
+#include <dirent.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "jtuner.h"
 
@@ -33,14 +37,40 @@
 
 #define MAX_COLLECT 100
 
+/* In segmented mode, the spectra are computed in segments of this many times
+ * cfg.slide_resync frames.  Each segment starts at a multiple of
+ * cfg.slide_resync frames, so that computing it from scratch gives the same
+ * results as continuing from the last one. */
+#define SEGMENT_RESYNCS 2
+
+/* columns of the median table: harmonics, error, then each interval */
+#define N_COLUMNS (2 + N_INTERVALS)
+
 typedef struct {
     float vals[MAX_COLLECT];
     int num_vals;
 } Collector;
 
-static Collector collect_off_by[N_PITCHES];
-static Collector collect_harm_stretch[N_PITCHES];
-static Collector collect_intervals[N_PITCHES][N_INTERVALS];
+/* All of the state for processing one file, so that several files can be
+ * processed at once. */
+typedef struct {
+    JTunerContext * ctx;
+
+    int stable_pitch;
+    int last_pitch, last_pitch_count;
+
+    Collector collect_off_by[N_PITCHES];
+    Collector collect_harm_stretch[N_PITCHES];
+    Collector collect_intervals[N_PITCHES][N_INTERVALS];
+} OfflineState;
+
+typedef float Medians[N_PITCHES][N_COLUMNS];
+
+/* analysis parameters; the sample rate of WAV files is taken from the header */
+static int raw_rate = SAMPLERATE;
+static int window_size = N_SAMPLES;
+static int hop_size = SAMPLES_PER_STEP;
+static int n_levels = 1;
 
 static const char * note_names[12] =
  {"C", "C♯", "D", "E♭", "E", "F", "F♯", "G", "A♭", "A", "B♭", "B"};
@@ -51,55 +81,55 @@ static void error_exit (const char * error)
     exit (1);
 }
 
-static bool read_step (FILE * in, float data[SAMPLES_PER_STEP])
-{
-    int16_t ibuf[SAMPLES_PER_STEP];
+/* Reads one step, or more until the window in the context has been filled. */
 
-    if (fread (ibuf, sizeof ibuf[0], SAMPLES_PER_STEP, in) != SAMPLES_PER_STEP)
-        return false;
-
-    for (int i = 0; i < SAMPLES_PER_STEP; i ++)
-        data[i] = ibuf[i] / 32767.0f;
+static bool read_samples (InputFile * in, JTunerContext * ctx)
+{
+    do
+    {
+        if (! input_read_step (in, context_next_step (ctx)))
+            return false;
+    }
+    while (! context_push_step (ctx));
 
     return true;
 }
 
-static bool read_samples (FILE * in, float data[N_SAMPLES])
+static OfflineState * state_new (const JTunerConfig * cfg)
 {
-    static bool filled = false;
+    OfflineState * state = calloc (1, sizeof (OfflineState));
+    if (! state)
+        return NULL;
 
-    if (filled)
-        memmove (data, data + SAMPLES_PER_STEP, (N_STEPS - 1) * SAMPLES_PER_STEP * sizeof data[0]);
-    else
+    if (! (state->ctx = context_new_multi (cfg, n_levels)))
     {
-        for (int i = 0; i < N_STEPS - 1; i ++)
-        {
-            if (! read_step (in, data + i * SAMPLES_PER_STEP))
-                return false;
-        }
-
-        filled = true;
+        free (state);
+        return NULL;
     }
 
-    return read_step (in, data + (N_STEPS - 1) * SAMPLES_PER_STEP);
-}
+    state->stable_pitch = MIN_PITCH;
+    state->last_pitch = -1;
 
-static int stable_pitch = 9; /* A0 */
+    return state;
+}
 
-static void detect_stable_pitch (int pitch)
+static void state_free (OfflineState * state)
 {
-    static int last_pitch = -1;
-    static int last_pitch_count = 0;
+    context_free (state->ctx);
+    free (state);
+}
 
-    if (pitch == last_pitch)
+static void detect_stable_pitch (OfflineState * state, int pitch)
+{
+    if (pitch == state->last_pitch)
     {
-        if (++ last_pitch_count == 10)
-            stable_pitch = last_pitch;
+        if (++ state->last_pitch_count == 10)
+            state->stable_pitch = state->last_pitch;
     }
     else
     {
-        last_pitch = pitch;
-        last_pitch_count = 0;
+        state->last_pitch = pitch;
+        state->last_pitch_count = 0;
     }
 }
 
@@ -109,33 +139,31 @@ static void collect_val (Collector * c, float val)
         c->vals[c->num_vals ++] = val;
 }
 
-static void collect_pitch (const RoundedPitch * pitch, float harm_stretch,
- const Intervals * iv)
+static void collect_pitch (OfflineState * state, const RoundedPitch * pitch,
+ float harm_stretch, const Intervals * iv)
 {
     if (pitch->pitch < MIN_PITCH || pitch->pitch > MAX_PITCH)
         return;
 
     int index = pitch->pitch - MIN_PITCH;
 
-    collect_val (& collect_off_by[index], pitch->off_by);
+    collect_val (& state->collect_off_by[index], pitch->off_by);
 
     if (harm_stretch > INVALID_VAL)
-        collect_val (& collect_harm_stretch[index], harm_stretch);
+        collect_val (& state->collect_harm_stretch[index], harm_stretch);
 
     for (int i = 0; i < iv->n_intervals; i ++)
-        collect_val (& collect_intervals[index][i], iv->intervals[i].off_by);
+        collect_val (& state->collect_intervals[index][i], iv->intervals[i].off_by);
 }
 
-static void process_freqs (float freqs[N_FREQS], FILE * out)
+static void process_tone (OfflineState * state, const DetectedTone * t, FILE * out)
 {
-    float min_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, stable_pitch - 3);
-    float max_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, stable_pitch + 3);
-    DetectedTone tone = tone_detect (freqs, min_tone_hz, max_tone_hz);
+    DetectedTone tone = * t;
     RoundedPitch pitch = round_to_pitch (OCTAVE_STRETCH, tone.tone_hz);
 
     if (pitch.pitch > INVALID_VAL)
     {
-        if (pitch.pitch == stable_pitch || pitch.pitch == stable_pitch + 1)
+        if (pitch.pitch == state->stable_pitch || pitch.pitch == state->stable_pitch + 1)
         {
             fprintf (out, "%s%d,%.02f Hz,%+.04f,%+.04f",
              note_names[pitch.pitch % 12], pitch.pitch / 12, tone.tone_hz,
@@ -150,10 +178,10 @@ static void process_freqs (float freqs[N_FREQS], FILE * out)
 
             fprintf (out, "\n");
 
-            collect_pitch (& pitch, tone.harm_stretch, & iv);
+            collect_pitch (state, & pitch, tone.harm_stretch, & iv);
         }
 
-        detect_stable_pitch (pitch.pitch);
+        detect_stable_pitch (state, pitch.pitch);
     }
 }
 
@@ -163,50 +191,52 @@ static int compare_float (const void * f1, const void * f2)
            (* (const float *) f1 > * (const float *) f2) ? 1 : 0;
 }
 
-static float compute_median (Collector * c)
+static float compute_median (float vals[], int num_vals)
 {
-    if (c->num_vals < 1)
+    if (num_vals < 1)
         return INVALID_VAL;
 
-    qsort (c->vals, (size_t) c->num_vals, sizeof (float), compare_float);
+    qsort (vals, (size_t) num_vals, sizeof (float), compare_float);
 
-    return (c->num_vals % 2) ? c->vals[c->num_vals / 2] :
-           0.5f * (c->vals[c->num_vals / 2] + c->vals[c->num_vals / 2 + 1]);
+    return (num_vals % 2) ? vals[num_vals / 2] :
+           0.5f * (vals[num_vals / 2 - 1] + vals[num_vals / 2]);
 }
 
-static void run_offline (FILE * in, FILE * out)
+static void compute_medians (OfflineState * state, Medians medians)
 {
-    float data[N_SAMPLES];
-    float freqs[N_FREQS];
-
-    fft_init ();
+    for (int index = 0; index < N_PITCHES; index ++)
+    {
+        Collector * c = & state->collect_harm_stretch[index];
+        medians[index][0] = compute_median (c->vals, c->num_vals);
 
-    fprintf (out, "Raw Data\n");
-    fprintf (out, "Note,Freq,Harm,Err\n");
+        c = & state->collect_off_by[index];
+        medians[index][1] = compute_median (c->vals, c->num_vals);
 
-    while (read_samples (in, data))
-    {
-        fft_run (data, freqs);
-        process_freqs (freqs, out);
+        for (int i = 0; i < N_INTERVALS; i ++)
+        {
+            c = & state->collect_intervals[index][i];
+            medians[index][2 + i] = compute_median (c->vals, c->num_vals);
+        }
     }
+}
 
-    fprintf (out, "\nMedians\n");
+static void write_medians (const Medians medians, FILE * out)
+{
     fprintf (out, "Note,Model,Harm,Err\n");
 
     for (int index = 0; index < N_PITCHES; index ++)
     {
         int pitch = MIN_PITCH + index;
         float model = model_harm_stretch (OCTAVE_STRETCH, pitch, pitch + 12);
-        float harm_stretch = compute_median (& collect_harm_stretch[index]);
-        float off_by = compute_median (& collect_off_by[index]);
 
         fprintf (out, "%s%d,%+.02f,%+.02f,%+.02f",
-         note_names[pitch % 12], pitch / 12, model, harm_stretch, off_by);
+         note_names[pitch % 12], pitch / 12, model, medians[index][0],
+         medians[index][1]);
 
         for (int i = 0; i < N_INTERVALS; i ++)
         {
             int interval_pitch = pitch + interval_widths[i];
-            float interval_off_by = compute_median (& collect_intervals[index][i]);
+            float interval_off_by = medians[index][2 + i];
 
             if (interval_off_by <= INVALID_VAL)
                 break;
@@ -219,22 +249,621 @@ static void run_offline (FILE * in, FILE * out)
     }
 }
 
-int main (int argc, char * * argv)
+/* The spectrum is computed over a fixed range covering every pitch that can be
+ * reported, not just the pitches around the stable pitch.  This way the
+ * spectrum of each frame does not depend on the results of the frames before
+ * it, and can be computed in parallel (see run_segmented). */
+
+static void analysis_bins (const JTunerConfig * cfg, int * min_bin, int * max_bin)
+{
+    tone_bins (cfg, pitch_to_tone_hz (OCTAVE_STRETCH, MIN_PITCH - 3),
+     pitch_to_tone_hz (OCTAVE_STRETCH, MAX_PITCH + 3), min_bin, max_bin);
+}
+
+static void process_frame (OfflineState * state, float freqs[], FILE * out)
+{
+    float min_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, state->stable_pitch - 3);
+    float max_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, state->stable_pitch + 3);
+
+    DetectedTone tone = tone_detect (state->ctx, freqs, min_tone_hz, max_tone_hz, true);
+    process_tone (state, & tone, out);
+}
+
+/* With several window sizes, the spectra are computed by tone_detect_multi,
+ * only around the stable pitch. */
+
+static void process_frame_multi (OfflineState * state, FILE * out)
+{
+    float min_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, state->stable_pitch - 3);
+    float max_tone_hz = pitch_to_tone_hz (OCTAVE_STRETCH, state->stable_pitch + 3);
+
+    DetectedTone tone = tone_detect_multi (state->ctx, min_tone_hz, max_tone_hz, true);
+    process_tone (state, & tone, out);
+}
+
+static void write_results (OfflineState * state, FILE * out, Medians medians)
+{
+    compute_medians (state, medians);
+
+    fprintf (out, "\nMedians\n");
+    write_medians (medians, out);
+}
+
+static void run_offline (OfflineState * state, InputFile * in, FILE * out,
+ Medians medians)
+{
+    float freqs[state->ctx->cfg.n_freqs];
+    int min_bin, max_bin;
+
+    analysis_bins (& state->ctx->cfg, & min_bin, & max_bin);
+
+    fprintf (out, "Raw Data\n");
+    fprintf (out, "Note,Freq,Harm,Err\n");
+
+    while (read_samples (in, state->ctx))
+    {
+        if (state->ctx->shorter)
+            process_frame_multi (state, out);
+        else
+        {
+            fft_slide (state->ctx, freqs, min_bin, max_bin);
+            process_frame (state, freqs, out);
+        }
+    }
+
+    write_results (state, out, medians);
+}
+
+/* Segmented mode: the input is split into segments of segment_frames frames,
+ * whose spectra are computed in parallel by the worker threads, each with its
+ * own context.  The frames interact only through the detection state, so the
+ * rest of the processing is done in order as each segment becomes ready.  The
+ * output is identical to that of run_offline. */
+
+typedef struct {
+    int segment;              /* segment held, or -1 if free */
+    bool ready;
+    int n_frames;
+    float * spectra;          /* n_frames rows of n_bins values */
+} SegmentSlot;
+
+typedef struct {
+    const char * in_name;
+    JTunerConfig cfg;
+    int segment_frames;
+    int min_bin, n_bins;
+    int n_segments, next_segment;
+    int n_slots;
+    SegmentSlot * slots;
+    bool error;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} Segmenter;
+
+static void compute_segment (Segmenter * sg, JTunerContext * ctx, InputFile * in,
+ int segment, SegmentSlot * slot)
+{
+    float freqs[sg->cfg.n_freqs];
+    int n_frames = 0;
+
+    context_reset (ctx);
+
+    long step = (long) segment * sg->segment_frames;
+
+    if (input_seek_step (in, step))
+    {
+        while (n_frames < sg->segment_frames && read_samples (in, ctx))
+        {
+            fft_slide (ctx, freqs, sg->min_bin, sg->min_bin + sg->n_bins - 1);
+            memcpy (slot->spectra + n_frames * sg->n_bins, freqs + sg->min_bin,
+             sg->n_bins * sizeof (float));
+            n_frames ++;
+        }
+    }
+
+    slot->n_frames = n_frames;
+}
+
+static void * segment_worker (void * arg)
+{
+    Segmenter * sg = arg;
+    JTunerContext * ctx = context_new (& sg->cfg);
+    InputFile * in = input_open (sg->in_name, sg->cfg.step_samples);
+
+    pthread_mutex_lock (& sg->mutex);
+
+    if (! ctx || ! in)
+    {
+        sg->error = true;
+        pthread_cond_broadcast (& sg->cond);
+    }
+
+    while (! sg->error && sg->next_segment < sg->n_segments)
+    {
+        int segment = sg->next_segment ++;
+        SegmentSlot * slot = & sg->slots[segment % sg->n_slots];
+
+        /* wait for the previous segment in this slot to be used */
+        while (! sg->error && slot->segment >= 0)
+            pthread_cond_wait (& sg->cond, & sg->mutex);
+
+        if (sg->error)
+            break;
+
+        slot->segment = segment;
+        slot->ready = false;
+
+        pthread_mutex_unlock (& sg->mutex);
+        compute_segment (sg, ctx, in, segment, slot);
+        pthread_mutex_lock (& sg->mutex);
+
+        slot->ready = true;
+        pthread_cond_broadcast (& sg->cond);
+    }
+
+    pthread_mutex_unlock (& sg->mutex);
+
+    if (in)
+        input_close (in);
+    if (ctx)
+        context_free (ctx);
+
+    return NULL;
+}
+
+/* Each worker opens the input separately, so it must be seekable. */
+
+static bool run_segmented (OfflineState * state, const char * in_name,
+ long n_steps, FILE * out, int n_jobs, Medians medians)
+{
+    const JTunerConfig * cfg = & state->ctx->cfg;
+    long n_frames = (n_steps >= cfg->n_steps) ? n_steps + 1 - cfg->n_steps : 0;
+    int segment_frames = SEGMENT_RESYNCS * cfg->slide_resync;
+
+    Segmenter sg = {
+        .in_name = in_name,
+        .cfg = * cfg,
+        .segment_frames = segment_frames,
+        .n_segments = (n_frames + segment_frames - 1) / segment_frames,
+        .n_slots = 2 * n_jobs,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    };
+
+    int max_bin;
+    analysis_bins (cfg, & sg.min_bin, & max_bin);
+    sg.n_bins = max_bin + 1 - sg.min_bin;
+
+    sg.slots = calloc (sg.n_slots, sizeof (SegmentSlot));
+    pthread_t * threads = malloc (n_jobs * sizeof (pthread_t));
+    if (! sg.slots || ! threads)
+        error_exit ("out of memory");
+
+    for (int i = 0; i < sg.n_slots; i ++)
+    {
+        sg.slots[i].segment = -1;
+        sg.slots[i].spectra = malloc (segment_frames * sg.n_bins * sizeof (float));
+        if (! sg.slots[i].spectra)
+            error_exit ("out of memory");
+    }
+
+    for (int j = 0; j < n_jobs; j ++)
+    {
+        if (pthread_create (& threads[j], NULL, segment_worker, & sg))
+            error_exit ("error creating thread");
+    }
+
+    /* frequencies outside the range are zero, as with fft_slide */
+    float freqs[cfg->n_freqs];
+    memset (freqs, 0, sizeof freqs);
+
+    fprintf (out, "Raw Data\n");
+    fprintf (out, "Note,Freq,Harm,Err\n");
+
+    for (int segment = 0; segment < sg.n_segments; segment ++)
+    {
+        SegmentSlot * slot = & sg.slots[segment % sg.n_slots];
+
+        pthread_mutex_lock (& sg.mutex);
+
+        while (! sg.error && ! (slot->segment == segment && slot->ready))
+            pthread_cond_wait (& sg.cond, & sg.mutex);
+
+        pthread_mutex_unlock (& sg.mutex);
+
+        if (sg.error)
+            break;
+
+        for (int f = 0; f < slot->n_frames; f ++)
+        {
+            memcpy (freqs + sg.min_bin, slot->spectra + f * sg.n_bins,
+             sg.n_bins * sizeof (float));
+            process_frame (state, freqs, out);
+        }
+
+        pthread_mutex_lock (& sg.mutex);
+        slot->segment = -1;
+        pthread_cond_broadcast (& sg.cond);
+        pthread_mutex_unlock (& sg.mutex);
+    }
+
+    for (int j = 0; j < n_jobs; j ++)
+        pthread_join (threads[j], NULL);
+
+    if (! sg.error)
+        write_results (state, out, medians);
+
+    for (int i = 0; i < sg.n_slots; i ++)
+        free (sg.slots[i].spectra);
+
+    free (sg.slots);
+    free (threads);
+
+    return ! sg.error;
+}
+
+/* Also true if the names are different paths (or links) to the same file. */
+
+static bool is_same_file (const char * name1, const char * name2)
+{
+    struct stat st1, st2;
+
+    if (! strcmp (name1, name2))
+        return true;
+
+    return ! stat (name1, & st1) && ! stat (name2, & st2) &&
+     st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/* If n_jobs is greater than one, segmented mode is used, unless the input is
+ * being streamed.  Multi-resolution analysis is always done in order, since
+ * the spectra are computed around the stable pitch.
+ *
+ * The results are kept in memory until the input is closed, and only then
+ * written to the output file, so that the output is never opened (and
+ * truncated) while the input is mapped. */
+
+static bool run_file (const char * in_name, const char * out_name, int n_jobs,
+ Medians medians)
 {
-    if (argc != 3)
-        error_exit ("Usage: jtuner-offline <file>.raw <file>.csv");
+    if (strcmp (in_name, "-") && is_same_file (in_name, out_name))
+    {
+        fprintf (stderr, "%s: output file would overwrite input\n", in_name);
+        return false;
+    }
 
-    FILE * in = fopen (argv[1], "rb");
+    InputFile * in = input_open (in_name, hop_size);
     if (! in)
-        error_exit ("error opening input file");
+        return false;
+
+    JTunerConfig cfg;
+    int rate = input_rate (in);
+    OfflineState * state = NULL;
+
+    if (! config_set (& cfg, rate ? rate : raw_rate, window_size, hop_size) ||
+     ! (state = state_new (& cfg)))
+    {
+        input_close (in);
+        return false;
+    }
+
+    char * results = NULL;
+    size_t results_size = 0;
+
+    FILE * out = open_memstream (& results, & results_size);
+    bool success = (out != NULL);
+    long n_steps = input_n_steps (in);
+
+    if (success && n_jobs > 1 && n_steps >= 0 && n_levels == 1)
+        success = run_segmented (state, in_name, n_steps, out, n_jobs, medians);
+    else if (success)
+        run_offline (state, in, out, medians);
+
+    input_close (in);
+    if (out && fclose (out))
+        success = false;
+
+    state_free (state);
+
+    if (success)
+    {
+        FILE * file = fopen (out_name, "wb");
+
+        success = (file != NULL) && fwrite (results, 1, results_size, file) == results_size;
+        if (file && fclose (file))
+            success = false;
+    }
+
+    free (results);
+    return success;
+}
+
+/* Batch mode: each input is either a file or a directory, which is searched
+ * for .raw and .wav files.  The results for each file are written to a .csv file next
+ * to it, and optionally a summary of all files is written as well.  Files are
+ * processed in parallel, one per worker thread. */
+
+typedef struct {
+    char * in_name, * out_name;
+    Medians medians;
+    bool success;
+} BatchFile;
+
+static BatchFile * batch_files;
+static int n_batch_files;
+static int next_batch_file;
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool is_input_name (const char * name)
+{
+    int len = strlen (name);
+    return len >= 5 && (! strcmp (name + len - 4, ".raw") ||
+     ! strcmp (name + len - 4, ".wav"));
+}
+
+static void add_batch_file (const char * in_name)
+{
+    const char * dot = strrchr (in_name, '.');
+    const char * slash = strrchr (in_name, '/');
+    int base_len = (dot && dot > slash) ? dot - in_name : strlen (in_name);
+
+    batch_files = realloc (batch_files, (n_batch_files + 1) * sizeof (BatchFile));
+    if (! batch_files)
+        error_exit ("out of memory");
+
+    BatchFile * file = & batch_files[n_batch_files ++];
+
+    file->in_name = strdup (in_name);
+    file->out_name = malloc (base_len + 5);
+    if (! file->in_name || ! file->out_name)
+        error_exit ("out of memory");
+
+    sprintf (file->out_name, "%.*s.csv", base_len, in_name);
+    file->success = false;
+}
+
+static int compare_name (const void * n1, const void * n2)
+{
+    return strcmp (* (char * const *) n1, * (char * const *) n2);
+}
+
+/* directories are listed in sorted order so that the summary is stable */
+
+static void add_batch_dir (const char * dir_name)
+{
+    DIR * dir = opendir (dir_name);
+    if (! dir)
+        error_exit ("error opening input directory");
+
+    char * * names = NULL;
+    int n_names = 0;
+    struct dirent * entry;
+
+    while ((entry = readdir (dir)))
+    {
+        if (! is_input_name (entry->d_name))
+            continue;
+
+        int len = strlen (entry->d_name);
+
+        names = realloc (names, (n_names + 1) * sizeof (char *));
+        if (! names || ! (names[n_names] = malloc (strlen (dir_name) + len + 2)))
+            error_exit ("out of memory");
+
+        sprintf (names[n_names ++], "%s/%s", dir_name, entry->d_name);
+    }
+
+    closedir (dir);
+
+    qsort (names, (size_t) n_names, sizeof (char *), compare_name);
+
+    for (int i = 0; i < n_names; i ++)
+    {
+        add_batch_file (names[i]);
+        free (names[i]);
+    }
+
+    free (names);
+}
+
+static void * batch_worker (void * arg)
+{
+    while (true)
+    {
+        pthread_mutex_lock (& batch_mutex);
+        int i = next_batch_file ++;
+        pthread_mutex_unlock (& batch_mutex);
+
+        if (i >= n_batch_files)
+            break;
+
+        BatchFile * file = & batch_files[i];
+        file->success = run_file (file->in_name, file->out_name, 1, file->medians);
+
+        if (! file->success)
+            fprintf (stderr, "error processing %s\n", file->in_name);
+    }
+
+    return NULL;
+}
+
+/* The summary gives, for each pitch, the median of the medians of the files
+ * in which that pitch was found. */
+
+static void write_summary (FILE * out)
+{
+    Medians medians;
+    float * vals = malloc (n_batch_files * sizeof (float));
+    if (! vals)
+        error_exit ("out of memory");
+
+    for (int index = 0; index < N_PITCHES; index ++)
+    {
+        for (int col = 0; col < N_COLUMNS; col ++)
+        {
+            int num_vals = 0;
+
+            for (int f = 0; f < n_batch_files; f ++)
+            {
+                float val = batch_files[f].medians[index][col];
+                if (batch_files[f].success && val > INVALID_VAL)
+                    vals[num_vals ++] = val;
+            }
+
+            medians[index][col] = compute_median (vals, num_vals);
+        }
+    }
+
+    free (vals);
+
+    fprintf (out, "Files\n");
+
+    for (int f = 0; f < n_batch_files; f ++)
+    {
+        if (batch_files[f].success)
+            fprintf (out, "%s\n", batch_files[f].in_name);
+    }
+
+    fprintf (out, "\nMedians\n");
+    write_medians ((const float (*)[N_COLUMNS]) medians, out);
+}
+
+static int run_batch (int n_inputs, char * * inputs, int n_jobs,
+ const char * summary_name)
+{
+    for (int i = 0; i < n_inputs; i ++)
+    {
+        DIR * dir = opendir (inputs[i]);
+
+        if (dir)
+        {
+            closedir (dir);
+            add_batch_dir (inputs[i]);
+        }
+        else if (is_input_name (inputs[i]))
+            add_batch_file (inputs[i]);
+        else
+        {
+            fprintf (stderr, "%s: not a .raw or .wav file\n", inputs[i]);
+            return 1;
+        }
+    }
+
+    if (n_jobs < 1)
+        n_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n_jobs < 1)
+        n_jobs = 1;
+    if (n_jobs > n_batch_files)
+        n_jobs = n_batch_files;
+
+    pthread_t * threads = malloc (n_jobs * sizeof (pthread_t));
+    if (! threads && n_jobs)
+        error_exit ("out of memory");
+
+    for (int j = 0; j < n_jobs; j ++)
+    {
+        if (pthread_create (& threads[j], NULL, batch_worker, NULL))
+            error_exit ("error creating thread");
+    }
+    for (int j = 0; j < n_jobs; j ++)
+        pthread_join (threads[j], NULL);
+
+    free (threads);
+
+    int n_failed = 0;
+
+    for (int f = 0; f < n_batch_files; f ++)
+    {
+        if (! batch_files[f].success)
+            n_failed ++;
+    }
+
+    if (summary_name)
+    {
+        FILE * out = fopen (summary_name, "wb");
+        if (! out)
+            error_exit ("error opening summary file");
+
+        write_summary (out);
+        fclose (out);
+    }
+
+    for (int f = 0; f < n_batch_files; f ++)
+    {
+        free (batch_files[f].in_name);
+        free (batch_files[f].out_name);
+    }
+
+    free (batch_files);
+
+    return n_failed ? 1 : 0;
+}
+
+static const char usage[] =
+ "Usage: jtuner-offline [-p] [-j jobs] [options] <file>.raw|wav|- <file>.csv\n"
+ "       jtuner-offline -b [-j jobs] [-s summary.csv] [options] <file or directory> ...\n"
+ "Options: [-m levels] [-r rate (raw input)] [-w window] [-H hop]";
+
+int main (int argc, char * * argv)
+{
+    bool batch = false, segmented = false;
+    int n_jobs = 0;
+    const char * summary_name = NULL;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "bj:m:ps:r:w:H:")) != -1)
+    {
+        if (opt == 'b')
+            batch = true;
+        else if (opt == 'j')
+            n_jobs = atoi (optarg);
+        else if (opt == 'm')
+            n_levels = atoi (optarg);
+        else if (opt == 'p')
+            segmented = true;
+        else if (opt == 's')
+            summary_name = optarg;
+        else if (opt == 'r')
+            raw_rate = atoi (optarg);
+        else if (opt == 'w')
+            window_size = atoi (optarg);
+        else if (opt == 'H')
+            hop_size = atoi (optarg);
+        else
+            error_exit (usage);
+    }
+
+    if (n_levels < 1 || n_levels > MAX_LEVELS)
+        error_exit ("number of window sizes must be 1 to 4");
+
+    JTunerConfig cfg;
+
+    /* the rate of WAV files is checked when they are opened */
+    if (! config_set (& cfg, raw_rate, window_size, hop_size))
+        error_exit ("invalid sample rate, window size, or hop size");
+
+    if (batch)
+    {
+        if (optind >= argc)
+            error_exit (usage);
+
+        return run_batch (argc - optind, argv + optind, n_jobs, summary_name);
+    }
+
+    if (argc - optind != 2)
+        error_exit (usage);
+
+    /* a single file is split into segments only if asked */
+    if (! segmented)
+        n_jobs = 1;
+    else if (n_jobs < 1)
+        n_jobs = sysconf (_SC_NPROCESSORS_ONLN);
 
-    FILE * out = fopen (argv[2], "wb");
-    if (! out)
-        error_exit ("error opening output file");
+    Medians medians;
 
-    run_offline (in, out);
+    if (! run_file (argv[optind], argv[optind + 1], n_jobs, medians))
+        error_exit ("error opening input or output file");
 
-    fclose (in);
-    fclose (out);
     return 0;
 }
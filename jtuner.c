@@ -21,58 +21,151 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "draw.h"
 
 #define MIN_FREQ_HZ 20
 #define MAX_FREQ_HZ 10000
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* new results are shown at most once per frame, at about 60 Hz */
+#define FRAME_MS 16
+
+typedef struct {
+    DetectedTone tone;
+    DetectedPitch pitch;
+    Intervals intervals;
+} Result;
+
+/* The results of each channel are passed to the GUI thread through a triple
+ * buffer, so that neither thread ever waits for the other.  The DSP thread
+ * fills in its own result, then exchanges it with the shared one, marking it
+ * as new.  The GUI thread takes the shared result in exchange for its own
+ * whenever it is marked as new. */
+
+#define RESULT_NEW 4
+
+typedef struct {
+    JTunerContext * ctx;
+    GtkWidget * tuner;
+
+    Result results[3];
+    int shared;             /* index of shared result, or'ed with RESULT_NEW */
+    int dsp_index;          /* used only by the DSP thread */
+    int gui_index;          /* used only by the GUI thread */
+    DetectState shown_state;  /* state of the last result, for the DSP thread */
+
+    TunerView view;         /* as shown, used only by the GUI thread */
+    DrawCache * cache;
+} Channel;
+
+/* Settings used by all channels during one step.  They are written by the DSP
+ * thread before the step_start barrier and only read until step_done. */
+typedef struct {
+    float octave_stretch;
+    float min_tone_hz, max_tone_hz;
+    bool band_limited;
+    bool quit;
+} StepParams;
 
 static float octave_stretch = 0.05f;
 static float target_octave = 0;
 
-static DetectedTone tone;
-static DetectedPitch pitch;
-static Intervals intervals;
+static const char * device = "default";
+static int n_channels = 1;
+static JTunerConfig config;
+static int n_levels = MAX_LEVELS;
+static int period_frames;       /* zero unless in low-latency mode */
+static bool realtime;
+static const char * trace_name;
+static bool trace_stats;
+static Channel channels[MAX_CHANNELS];
 
-static GtkWidget * tuner;
 static bool quit_flag;
 
+static int n_workers;
+static pthread_barrier_t step_start, step_done;
+static StepParams step;
+
+static bool redraw_pending;
+
 static void disable_fill (GtkWidget * window)
 {
     GdkWindow * gdk_window = gtk_widget_get_window (window);
     gdk_window_set_back_pixmap (gdk_window, NULL, FALSE);
 }
 
-static gboolean redraw (GtkWidget * window, GdkEventExpose * event)
+static gboolean redraw (GtkWidget * window, GdkEventExpose * event, Channel * ch)
 {
+    uint64_t start = trace_start ();
+
     cairo_t * cr = gdk_cairo_create (gtk_widget_get_window (window));
-    pthread_mutex_lock (& mutex);
-    draw_tuner (window, cr, & tone, & pitch, & intervals);
-    pthread_mutex_unlock (& mutex);
+    draw_tuner (window, ch->cache, cr, & event->area, & ch->view);
     cairo_destroy (cr);
+
+    trace_end (TRACE_DRAW, start);
     return TRUE;
 }
 
-static gboolean queue_redraw (void * arg)
+/* Runs once per frame while there are new results.  Only the parts of each
+ * tuner that look different are redrawn. */
+
+static gboolean show_results (void * unused)
 {
-    gtk_widget_queue_draw (tuner);
+    /* cleared first, so that a result published from now on is not missed */
+    __atomic_store_n (& redraw_pending, false, __ATOMIC_SEQ_CST);
+
+    uint64_t start = trace_start ();
+
+    for (int c = 0; c < n_channels; c ++)
+    {
+        Channel * ch = & channels[c];
+
+        if (! (__atomic_load_n (& ch->shared, __ATOMIC_SEQ_CST) & RESULT_NEW))
+            continue;
+
+        ch->gui_index = __atomic_exchange_n (& ch->shared, ch->gui_index,
+         __ATOMIC_ACQ_REL) & ~RESULT_NEW;
+
+        const Result * r = & ch->results[ch->gui_index];
+
+        TunerView view;
+        GdkRectangle rects[N_PARTS];
+
+        draw_format (& view, & r->tone, & r->pitch, & r->intervals);
+        int n_rects = draw_changes (ch->tuner, & ch->view, & view, rects);
+
+        for (int i = 0; i < n_rects; i ++)
+            gtk_widget_queue_draw_area (ch->tuner, rects[i].x, rects[i].y,
+             rects[i].width, rects[i].height);
+    }
+
+    trace_end (TRACE_SHOW, start);
     return FALSE;
 }
 
+/* Called from the DSP thread.  Results published during the same frame are
+ * shown together. */
+
+static void schedule_show_results (void)
+{
+    if (! __atomic_exchange_n (& redraw_pending, true, __ATOMIC_SEQ_CST))
+        g_timeout_add (FRAME_MS, show_results, NULL);
+}
+
+/* The settings are read by the DSP thread once per step.  Each is read
+ * atomically, but the two may be read from different moments. */
+
 static void adjust_stretch (GtkWidget * spin)
 {
-    pthread_mutex_lock (& mutex);
-    octave_stretch = gtk_spin_button_get_value ((GtkSpinButton *) spin);
-    pthread_mutex_unlock (& mutex);
+    float value = gtk_spin_button_get_value ((GtkSpinButton *) spin);
+    __atomic_store (& octave_stretch, & value, __ATOMIC_RELAXED);
 }
 
 static void adjust_target (GtkWidget * spin)
 {
-    pthread_mutex_lock (& mutex);
-    target_octave = gtk_spin_button_get_value ((GtkSpinButton *) spin);
-    pthread_mutex_unlock (& mutex);
+    float value = gtk_spin_button_get_value ((GtkSpinButton *) spin);
+    __atomic_store (& target_octave, & value, __ATOMIC_RELAXED);
 }
 
 static void error_exit (const char * error)
@@ -81,70 +174,211 @@ static void error_exit (const char * error)
     exit (1);
 }
 
-static void * io_worker (void * arg)
+static void analyze_channel (Channel * ch)
 {
-    fft_init ();
+    uint64_t start = trace_start ();
+
+    /* with a target octave, only the frequencies needed are computed */
+    DetectedTone new_tone = tone_detect_multi (ch->ctx, step.min_tone_hz,
+     step.max_tone_hz, step.band_limited);
+    DetectedPitch new_pitch = pitch_identify (ch->ctx, step.octave_stretch,
+     new_tone.tone_hz);
+
+    if (new_pitch.state == DETECT_UPDATE ||
+     (new_pitch.state == DETECT_NONE && ch->shown_state != DETECT_NONE))
+    {
+        Result * r = & ch->results[ch->dsp_index];
 
-    if (! io_init ())
+        r->tone = new_tone;
+        r->pitch = new_pitch;
+        r->intervals = identify_intervals (step.octave_stretch, new_pitch.pitch,
+         new_tone.overtones_hz);
+
+        ch->shown_state = new_pitch.state;
+        ch->dsp_index = __atomic_exchange_n (& ch->shared,
+         ch->dsp_index | RESULT_NEW, __ATOMIC_ACQ_REL) & ~RESULT_NEW;
+
+        schedule_show_results ();
+    }
+
+    trace_end (TRACE_ANALYZE, start);
+}
+
+/* Channels are divided evenly between the workers, one of which is the DSP
+ * thread itself. */
+
+static void analyze_channels (int worker)
+{
+    for (int c = worker; c < n_channels; c += n_workers)
+        analyze_channel (& channels[c]);
+}
+
+static void * analyze_worker (void * arg)
+{
+    int worker = GPOINTER_TO_INT (arg);
+
+    char name[16];
+    snprintf (name, sizeof name, "worker %d", worker);
+    trace_set_thread (name);
+
+    while (true)
+    {
+        pthread_barrier_wait (& step_start);
+
+        if (step.quit)
+            break;
+
+        analyze_channels (worker);
+
+        pthread_barrier_wait (& step_done);
+    }
+
+    return NULL;
+}
+
+static void * dsp_worker (void * arg)
+{
+    if (! io_init (device, & config, n_channels, period_frames, realtime))
         error_exit ("audio init error");
 
-    float data[N_SAMPLES];
-    float freqs[N_FREQS];
+    trace_set_thread ("dsp");
 
-    bool quit = false;
+    JTunerContext * ctx[MAX_CHANNELS];
 
-    while (! quit)
+    for (int c = 0; c < n_channels; c ++)
     {
-        if (! io_read_samples (data))
+        if (! (ctx[c] = channels[c].ctx = context_new_multi (& config, n_levels)))
+            error_exit ("out of memory");
+    }
+
+    long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    n_workers = (n_cpus >= 1 && n_cpus < n_channels) ? n_cpus : n_channels;
+
+    pthread_barrier_init (& step_start, NULL, n_workers);
+    pthread_barrier_init (& step_done, NULL, n_workers);
+
+    pthread_t workers[MAX_CHANNELS];
+
+    for (int w = 1; w < n_workers; w ++)
+        pthread_create (& workers[w], NULL, analyze_worker, GINT_TO_POINTER (w));
+
+    while (! step.quit)
+    {
+        if (! io_read_samples (ctx))
             error_exit ("audio read error");
 
-        fft_run (data, freqs);
+        float target;
 
-        pthread_mutex_lock (& mutex);
+        __atomic_load (& octave_stretch, & step.octave_stretch, __ATOMIC_RELAXED);
+        __atomic_load (& target_octave, & target, __ATOMIC_RELAXED);
 
-        float min_tone_hz = MIN_FREQ_HZ;
-        float max_tone_hz = MAX_FREQ_HZ;
+        step.min_tone_hz = MIN_FREQ_HZ;
+        step.max_tone_hz = MAX_FREQ_HZ;
+        step.band_limited = (target > 0);
 
-        if (target_octave > 0)
+        if (step.band_limited)
         {
-            min_tone_hz = pitch_to_tone_hz (octave_stretch, 12 * target_octave - 6);
-            max_tone_hz = pitch_to_tone_hz (octave_stretch, 12 * target_octave + 6);
+            step.min_tone_hz = pitch_to_tone_hz (step.octave_stretch, 12 * target - 6);
+            step.max_tone_hz = pitch_to_tone_hz (step.octave_stretch, 12 * target + 6);
         }
 
-        DetectedTone new_tone = tone_detect (freqs, min_tone_hz, max_tone_hz);
-        DetectedPitch new_pitch = pitch_identify (octave_stretch, new_tone.tone_hz);
+        step.quit = __atomic_load_n (& quit_flag, __ATOMIC_ACQUIRE);
+
+        pthread_barrier_wait (& step_start);
 
-        if (new_pitch.state == DETECT_UPDATE ||
-         (new_pitch.state == DETECT_NONE && pitch.state != DETECT_NONE))
+        if (! step.quit)
         {
-            tone = new_tone;
-            pitch = new_pitch;
-            intervals = identify_intervals (octave_stretch, pitch.pitch, tone.overtones_hz);
-            g_timeout_add (0, queue_redraw, NULL);
+            analyze_channels (0);
+
+            uint64_t start = trace_start ();
+            pthread_barrier_wait (& step_done);
+            trace_end (TRACE_BARRIER, start);
         }
+    }
 
-        quit = quit_flag;
+    for (int w = 1; w < n_workers; w ++)
+        pthread_join (workers[w], NULL);
 
-        pthread_mutex_unlock (& mutex);
-    }
+    pthread_barrier_destroy (& step_start);
+    pthread_barrier_destroy (& step_done);
+
+    for (int c = 0; c < n_channels; c ++)
+        context_free (ctx[c]);
 
     io_cleanup ();
 
     return NULL;
 }
 
-int main (void)
+int main (int argc, char * * argv)
 {
-    gtk_init (NULL, NULL);
+    gtk_init (& argc, & argv);
+
+    int rate = SAMPLERATE, window_size = N_SAMPLES, hop_size = SAMPLES_PER_STEP;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "c:d:l:m:r:w:H:IRT:")) != -1)
+    {
+        if (opt == 'c')
+            n_channels = atoi (optarg);
+        else if (opt == 'd')
+            device = optarg;
+        else if (opt == 'l')
+            period_frames = atoi (optarg);
+        else if (opt == 'm')
+            n_levels = atoi (optarg);
+        else if (opt == 'r')
+            rate = atoi (optarg);
+        else if (opt == 'w')
+            window_size = atoi (optarg);
+        else if (opt == 'H')
+            hop_size = atoi (optarg);
+        else if (opt == 'I')
+            trace_stats = true;
+        else if (opt == 'R')
+            realtime = true;
+        else if (opt == 'T')
+            trace_name = optarg;
+        else
+            error_exit ("Usage: jtuner [-c channels] [-d device] [-l period] "
+             "[-m levels] [-r rate] [-w window] [-H hop] [-R] "
+             "[-I (stats)] [-T trace.json]");
+    }
+
+    if (n_channels < 1 || n_channels > MAX_CHANNELS)
+        error_exit ("number of channels must be 1 to 8");
+    if (period_frames < 0)
+        error_exit ("period size must not be negative");
+    if (n_levels < 1 || n_levels > MAX_LEVELS)
+        error_exit ("number of window sizes must be 1 to 4");
+    if (! config_set (& config, rate, window_size, hop_size))
+        error_exit ("invalid sample rate, window size, or hop size");
+
+    for (int c = 0; c < n_channels; c ++)
+    {
+        Result * r = & channels[c].results[2];
 
-    pthread_t io_thread;
-    pthread_create (& io_thread, NULL, io_worker, NULL);
+        channels[c].shared = 0;
+        channels[c].dsp_index = 1;
+        channels[c].gui_index = 2;
+
+        draw_format (& channels[c].view, & r->tone, & r->pitch, & r->intervals);
+    }
+
+    if ((trace_name || trace_stats) && ! trace_init (trace_name, trace_stats))
+        error_exit ("error opening trace file");
+
+    trace_set_thread ("gui");
+
+    pthread_t dsp_thread;
+    pthread_create (& dsp_thread, NULL, dsp_worker, NULL);
 
     gtk_window_set_default_icon_name ("jtuner");
 
     GtkWidget * window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title ((GtkWindow *) window, "JTuner");
-    gtk_window_set_default_size ((GtkWindow *) window, 600, 400);
+    gtk_window_set_default_size ((GtkWindow *) window, 600,
+     (n_channels > 1) ? 250 * n_channels : 400);
 
     g_signal_connect (window, "realize", (GCallback) disable_fill, NULL);
     g_signal_connect (window, "destroy", (GCallback) gtk_main_quit, NULL);
@@ -152,10 +386,15 @@ int main (void)
     GtkWidget * vbox = gtk_vbox_new (FALSE, 0);
     gtk_container_add ((GtkContainer *) window, vbox);
 
-    tuner = gtk_drawing_area_new ();
-    gtk_box_pack_start ((GtkBox *) vbox, tuner, TRUE, TRUE, 0);
+    /* one tuner for each channel, from top to bottom */
+    for (int c = 0; c < n_channels; c ++)
+    {
+        channels[c].tuner = gtk_drawing_area_new ();
+        channels[c].cache = draw_cache_new ();
+        gtk_box_pack_start ((GtkBox *) vbox, channels[c].tuner, TRUE, TRUE, 0);
 
-    g_signal_connect (tuner, "expose-event", (GCallback) redraw, NULL);
+        g_signal_connect (channels[c].tuner, "expose-event", (GCallback) redraw, & channels[c]);
+    }
 
     GtkWidget * hbox = gtk_hbox_new (FALSE, 6);
     gtk_container_set_border_width ((GtkContainer *) hbox, 3);
@@ -183,11 +422,14 @@ int main (void)
 
     gtk_main ();
 
-    pthread_mutex_lock (& mutex);
-    quit_flag = TRUE;
-    pthread_mutex_unlock (& mutex);
+    __atomic_store_n (& quit_flag, true, __ATOMIC_RELEASE);
+
+    pthread_join (dsp_thread, NULL);
+
+    trace_cleanup ();
 
-    pthread_join (io_thread, NULL);
+    for (int c = 0; c < n_channels; c ++)
+        draw_cache_free (channels[c].cache);
 
     return 0;
 }
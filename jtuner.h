@@ -22,66 +22,131 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
-#define SAMPLERATE 44100
+#include "libjtuner.h"
+
+/* Short names for the types and constants of the public interface, which are
+ * prefixed there so as not to clash with names used by applications */
+#define N_OVERTONES JTUNER_N_OVERTONES
+#define N_INTERVALS JTUNER_N_INTERVALS
+#define INVALID_VAL JTUNER_INVALID_VAL
+
+#define DETECT_NONE JTUNER_DETECT_NONE
+#define DETECT_UPDATE JTUNER_DETECT_UPDATE
+#define DETECT_KEEP JTUNER_DETECT_KEEP
 
+typedef JTunerDetectState DetectState;
+typedef JTunerDetectedTone DetectedTone;
+typedef JTunerDetectedPitch DetectedPitch;
+typedef JTunerRoundedPitch RoundedPitch;
+typedef JTunerIntervals Intervals;
+
+/* Default analysis parameters (see JTunerConfig) */
+#define SAMPLERATE 44100
 #define N_SAMPLES 32768
-#define N_SAMPLES_LOG2 15
+#define SAMPLES_PER_STEP 2048
 
-#define N_STEPS 16
+/* Limits on the analysis parameters */
+#define MIN_SAMPLERATE 8000
+#define MAX_SAMPLERATE 192000
+#define MIN_SAMPLES 1024
+#define MAX_SAMPLES 65536
+#define MIN_SAMPLES_PER_STEP 64
 
-#define SAMPLES_PER_STEP (N_SAMPLES / N_STEPS)
+/* The spectrum computed by fft_slide is resynchronized with a full DFT after
+ * this many windows, so that rounding errors cannot accumulate. */
+#define SLIDE_RESYNC_WINDOWS 4
+
+#define MAX_CHANNELS 8
+
+/* Number of window sizes used in multi-resolution analysis, including the
+ * longest (see tone_detect_multi) */
+#define MAX_LEVELS 4
 
 #define TIMEIN 5
 #define TIMEOUT 10
 
-#define N_FREQS (N_SAMPLES / 2 + 1)
-#define N_OVERTONES 16
-#define N_INTERVALS 5
-
 #define C4_PITCH 48
 #define A4_PITCH 57
 
 #define A4_TONE_HZ 440
 
-#define INVALID_VAL -999
-
-typedef enum {
-    DETECT_NONE,
-    DETECT_UPDATE,
-    DETECT_KEEP
-} DetectState;
-
+/* Sample rate, window size, and step size of the analysis.  The window and
+ * step sizes are powers of 2.  Set with config_set, which fills in the derived
+ * values. */
 typedef struct {
-    float tone_hz;
-    float harm_score;
-    float harm_stretch;
-    float overtones_hz[N_OVERTONES];
-} DetectedTone;
+    int rate;
+    int n_samples;          /* samples per window */
+    int step_samples;       /* samples per step */
+    int n_steps;            /* steps per window */
+    int n_freqs;            /* frequency bins, from 0 to n_samples/2 */
+    int slide_resync;       /* steps between full DFTs in fft_slide */
+} JTunerConfig;
+
+/* Lookup tables for one window and step size (fft.c) */
+typedef struct FFTPlan FFTPlan;
+
+/* All of the state needed to analyze one stream of samples.  Several contexts
+ * may be used at once, from different threads. */
+typedef struct JTunerContext {
+    JTunerConfig cfg;
+    const FFTPlan * plan;
+
+    /* context for the next shorter window, fed the same samples, in
+     * multi-resolution analysis; otherwise NULL (context.c) */
+    struct JTunerContext * shorter;
+
+    /* ring buffer holding the last cfg.n_samples samples (context.c) */
+    float * ring;
+    int n_steps;            /* steps filled, up to cfg.n_steps */
+    int next_step;          /* step to be overwritten next */
+
+    /* spectrum of the last window, without the Hamming window (fft.c) */
+    float * slide_re, * slide_im;     /* cfg.n_freqs values, 64-byte aligned */
+    float * slide_removed;            /* cfg.step_samples values */
+    int slide_count;
+    int slide_min, slide_max;
+
+    /* tone.c */
+    float last_tone_hz;
+    float new_tone_hz;      /* see tone_detect_multi */
+    int new_tone_steps;
+
+    /* pitch.c */
+    int last_pitch;
+    int timein, timeout;
+} JTunerContext;
+
+/* context.c */
+bool config_set (JTunerConfig * cfg, int rate, int n_samples, int step_samples);
+JTunerContext * context_new (const JTunerConfig * cfg);
+JTunerContext * context_new_multi (const JTunerConfig * cfg, int n_levels);
+void context_reset (JTunerContext * ctx);
+void context_free (JTunerContext * ctx);
+float * context_next_step (JTunerContext * ctx);
+bool context_push_step (JTunerContext * ctx);
+void context_skip_steps (JTunerContext * ctx);
 
-typedef struct {
-    DetectState state;
-    int pitch;
-    float off_by;
-} DetectedPitch;
+/* fft.c */
+const FFTPlan * fft_plan (int n_samples, int step_samples);
+void fft_run (const JTunerContext * ctx, float freqs[]);
+void fft_slide (JTunerContext * ctx, float freqs[], int min_bin, int max_bin);
 
-typedef struct {
-    int pitch;
-    float off_by;
-} RoundedPitch;
+/* input.c */
+typedef struct InputFile InputFile;
 
-typedef struct {
-    int n_intervals;
-    RoundedPitch intervals[N_INTERVALS];
-} Intervals;
-
-/* fft.c */
-void fft_init (void);
-void fft_run (const float data[N_SAMPLES], float freqs[N_FREQS]);
+InputFile * input_open (const char * name, int step_samples);
+void input_close (InputFile * in);
+int input_rate (InputFile * in);
+long input_n_steps (InputFile * in);
+bool input_seek_step (InputFile * in, long step);
+bool input_read_step (InputFile * in, float data[]);
 
 /* io.c */
-bool io_init (void);
-bool io_read_samples (float data[N_SAMPLES]);
+bool io_init (const char * device, const JTunerConfig * cfg, int n_channels,
+ int period_frames, bool realtime);
+bool io_read_samples (JTunerContext * ctx[]);
 void io_cleanup (void);
 
 /* pitch.c */
@@ -90,10 +155,58 @@ extern const int interval_widths[N_INTERVALS];
 float model_harm_stretch (float s, float pitch1, float pitch2);
 float pitch_to_tone_hz (float s, float pitch);
 RoundedPitch round_to_pitch (float s, float tone_hz);
-DetectedPitch pitch_identify (float s, float tone_hz);
+DetectedPitch pitch_identify (JTunerContext * ctx, float s, float tone_hz);
 Intervals identify_intervals (float s, int root_pitch, const float overtones_hz[N_OVERTONES]);
 
+/* trace.c */
+typedef enum {
+    TRACE_CAPTURE,          /* waiting for and reading samples from ALSA */
+    TRACE_CONVERT,
+    TRACE_XRUN,             /* counted only */
+    TRACE_DROP,             /* step dropped because the queue was full */
+    TRACE_QUEUE_WAIT,       /* analysis thread waiting for samples */
+    TRACE_ANALYZE,          /* one channel, from spectrum to pitch */
+    TRACE_SLIDE,
+    TRACE_PEAKS,
+    TRACE_TONE,             /* scoring the peaks found as tones */
+    TRACE_BARRIER,          /* DSP thread waiting for the other workers */
+    TRACE_SHOW,             /* GUI thread taking new results */
+    TRACE_DRAW,
+    TRACE_PUBLISH,
+    N_TRACE_STAGES
+} TraceStage;
+
+extern bool trace_enabled;
+
+bool trace_init (const char * trace_name, bool stats);
+void trace_cleanup (void);
+void trace_set_thread (const char * name);
+uint64_t trace_now (void);
+void trace_event (TraceStage stage, uint64_t start);
+void trace_print_stats (FILE * out);
+
+/* Around each stage:
+ *     uint64_t start = trace_start ();
+ *     ...
+ *     trace_end (TRACE_STAGE, start); */
+
+static inline uint64_t trace_start (void)
+{
+    return __builtin_expect (trace_enabled, false) ? trace_now () : 0;
+}
+
+static inline void trace_end (TraceStage stage, uint64_t start)
+{
+    if (__builtin_expect (trace_enabled, false))
+        trace_event (stage, start);
+}
+
 /* tone.c */
-DetectedTone tone_detect (const float freqs[N_FREQS], float min_tone_hz, float max_tone_hz);
+void tone_bins (const JTunerConfig * cfg, float min_tone_hz, float max_tone_hz,
+ int * min_bin, int * max_bin);
+DetectedTone tone_detect (JTunerContext * ctx, const float freqs[],
+ float min_tone_hz, float max_tone_hz, bool band_limited);
+DetectedTone tone_detect_multi (JTunerContext * ctx, float min_tone_hz,
+ float max_tone_hz, bool band_limited);
 
 #endif // JTUNER_H
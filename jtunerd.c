@@ -0,0 +1,482 @@
+/*
+ * JTuner - jtunerd.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Headless version of jtuner.  The results are published to any number of
+ * subscribers over a Unix domain socket, one line of JSON for each result:
+ *
+ *   {"time":1.234,"channel":0,"tone_hz":440.12,"note":"A4","pitch":57,
+ *    "off_by":0.021,"intervals":[{"note":"A5","pitch":69,"off_by":0.003}]}
+ *
+ * When no pitch is detected any more, a line with "pitch":null is sent.  Time
+ * is in seconds since the daemon was started.
+ *
+ * The DSP thread never waits for the subscribers.  It formats each result and
+ * passes it to the server thread through a single-producer, single-consumer
+ * queue, waking it through a pipe.  The server thread accepts subscribers and
+ * sends them the results without blocking; a subscriber that does not keep up
+ * (so that a whole line cannot be sent) is disconnected.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jtuner.h"
+
+#define MIN_FREQ_HZ 20
+#define MAX_FREQ_HZ 10000
+
+#define MAX_SUBSCRIBERS 16
+
+/* results waiting to be sent; if the queue is full, new ones are dropped */
+#define QUEUE_MSGS 64
+#define MSG_SIZE 512
+
+typedef struct {
+    JTunerContext * ctx;
+    DetectState shown_state;
+} Channel;
+
+static float octave_stretch = 0.05f;
+static float target_octave = 0;
+
+static const char * device = "default";
+static const char * socket_path;
+static int n_channels = 1;
+static JTunerConfig config;
+static int n_levels = MAX_LEVELS;
+static int period_frames;       /* zero unless in low-latency mode */
+static bool realtime;
+static const char * trace_name;
+static bool trace_stats;
+static Channel channels[MAX_CHANNELS];
+
+static volatile sig_atomic_t quit_flag;
+
+static struct timespec start_time;
+
+static char queue[QUEUE_MSGS][MSG_SIZE];
+static unsigned queue_head;     /* written only by the DSP thread */
+static unsigned queue_tail;     /* written only by the server thread */
+static int wake_pipe[2];
+
+static int listen_fd = -1;
+static int subscribers[MAX_SUBSCRIBERS];
+static int n_subscribers;
+
+static const char * note_names[12] =
+ {"C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B"};
+
+static void error_exit (const char * error)
+{
+    fprintf (stderr, "%s\n", error);
+    exit (1);
+}
+
+static void handle_quit (int sig)
+{
+    quit_flag = true;
+}
+
+static double elapsed_time (void)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, & now);
+    return (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) * 1e-9;
+}
+
+/* Returns the length of the line, or 0 if it did not fit. */
+
+static int format_result (char * buf, int channel, const DetectedTone * tone,
+ const DetectedPitch * pitch, const Intervals * iv)
+{
+    int len = snprintf (buf, MSG_SIZE, "{\"time\":%.3f,\"channel\":%d",
+     elapsed_time (), channel);
+
+    if (pitch->state == DETECT_NONE)
+        len += snprintf (buf + len, MSG_SIZE - len, ",\"pitch\":null}\n");
+    else
+    {
+        len += snprintf (buf + len, MSG_SIZE - len, ",\"tone_hz\":%.2f,"
+         "\"note\":\"%s%d\",\"pitch\":%d,\"off_by\":%.3f,\"intervals\":[",
+         tone->tone_hz, note_names[pitch->pitch % 12], pitch->pitch / 12,
+         pitch->pitch, pitch->off_by);
+
+        for (int i = 0; i < iv->n_intervals && len < MSG_SIZE; i ++)
+        {
+            int iv_pitch = iv->intervals[i].pitch;
+
+            len += snprintf (buf + len, MSG_SIZE - len,
+             "%s{\"note\":\"%s%d\",\"pitch\":%d,\"off_by\":%.3f}", i ? "," : "",
+             note_names[iv_pitch % 12], iv_pitch / 12, iv_pitch,
+             iv->intervals[i].off_by);
+        }
+
+        if (len < MSG_SIZE)
+            len += snprintf (buf + len, MSG_SIZE - len, "]}\n");
+    }
+
+    return (len < MSG_SIZE) ? len : 0;
+}
+
+/* Called from the DSP thread.  Never blocks. */
+
+static void publish_result (int channel, const DetectedTone * tone,
+ const DetectedPitch * pitch, const Intervals * iv)
+{
+    unsigned head = queue_head;
+
+    if (head - __atomic_load_n (& queue_tail, __ATOMIC_ACQUIRE) == QUEUE_MSGS)
+        return;
+
+    if (! format_result (queue[head % QUEUE_MSGS], channel, tone, pitch, iv))
+        return;
+
+    __atomic_store_n (& queue_head, head + 1, __ATOMIC_RELEASE);
+
+    /* the pipe is non-blocking; if it is full, the server is awake anyway */
+    if (write (wake_pipe[1], "", 1) < 0)
+        return;
+}
+
+static void remove_subscriber (int s)
+{
+    close (subscribers[s]);
+    subscribers[s] = subscribers[-- n_subscribers];
+}
+
+static void accept_subscribers (void)
+{
+    int fd;
+
+    while ((fd = accept (listen_fd, NULL, NULL)) >= 0)
+    {
+        if (n_subscribers == MAX_SUBSCRIBERS)
+        {
+            close (fd);
+            continue;
+        }
+
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+        subscribers[n_subscribers ++] = fd;
+    }
+}
+
+static void send_results (void)
+{
+    uint64_t start = trace_start ();
+
+    char buf[64];
+    while (read (wake_pipe[0], buf, sizeof buf) > 0)
+        ;
+
+    unsigned tail = queue_tail;
+    unsigned head = __atomic_load_n (& queue_head, __ATOMIC_ACQUIRE);
+
+    for (; tail != head; tail ++)
+    {
+        const char * msg = queue[tail % QUEUE_MSGS];
+        int len = strlen (msg);
+
+        for (int s = 0; s < n_subscribers; )
+        {
+            /* a partial line would corrupt the stream */
+            if (send (subscribers[s], msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+                remove_subscriber (s);
+            else
+                s ++;
+        }
+    }
+
+    __atomic_store_n (& queue_tail, tail, __ATOMIC_RELEASE);
+
+    trace_end (TRACE_PUBLISH, start);
+}
+
+static void * server_worker (void * unused)
+{
+    trace_set_thread ("server");
+
+    while (! quit_flag)
+    {
+        struct pollfd fds[2] = {
+            {.fd = listen_fd, .events = POLLIN},
+            {.fd = wake_pipe[0], .events = POLLIN}
+        };
+
+        /* the timeout bounds the delay in noticing quit_flag */
+        if (poll (fds, 2, 500) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN)
+            accept_subscribers ();
+        if (fds[1].revents & POLLIN)
+            send_results ();
+    }
+
+    while (n_subscribers)
+        remove_subscriber (n_subscribers - 1);
+
+    return NULL;
+}
+
+/* The socket file is removed however the daemon exits, once it has been
+ * created (and not before, since it might belong to another instance). */
+static void remove_socket (void)
+{
+    unlink (socket_path);
+}
+
+/* A socket left behind by an earlier run is replaced, but not one that is
+ * still accepting connections, nor anything that is not a socket. */
+static void remove_stale_socket (const struct sockaddr_un * addr)
+{
+    struct stat st;
+
+    if (lstat (socket_path, & st) < 0)
+        return;
+
+    if (! S_ISSOCK (st.st_mode))
+    {
+        fprintf (stderr, "%s exists and is not a socket\n", socket_path);
+        exit (1);
+    }
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    bool in_use = (fd >= 0 && connect (fd, (const struct sockaddr *) addr,
+     sizeof * addr) == 0);
+
+    if (fd >= 0)
+        close (fd);
+
+    if (in_use)
+    {
+        fprintf (stderr, "jtunerd already running on %s\n", socket_path);
+        exit (1);
+    }
+
+    unlink (socket_path);
+}
+
+static void open_socket (void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen (socket_path) >= sizeof addr.sun_path)
+        error_exit ("socket path too long");
+
+    strcpy (addr.sun_path, socket_path);
+
+    remove_stale_socket (& addr);
+
+    if ((listen_fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+     bind (listen_fd, (struct sockaddr *) & addr, sizeof addr) < 0)
+    {
+        perror (socket_path);
+        exit (1);
+    }
+
+    atexit (remove_socket);
+
+    if (listen (listen_fd, MAX_SUBSCRIBERS) < 0)
+    {
+        perror (socket_path);
+        exit (1);
+    }
+
+    fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK);
+
+    if (pipe (wake_pipe) < 0)
+        error_exit ("pipe error");
+
+    for (int i = 0; i < 2; i ++)
+        fcntl (wake_pipe[i], F_SETFL, fcntl (wake_pipe[i], F_GETFL) | O_NONBLOCK);
+}
+
+static void close_socket (void)
+{
+    close (listen_fd);
+    close (wake_pipe[0]);
+    close (wake_pipe[1]);
+}
+
+static void analyze_channel (int c, float min_tone_hz, float max_tone_hz,
+ bool band_limited)
+{
+    Channel * ch = & channels[c];
+
+    uint64_t start = trace_start ();
+
+    DetectedTone new_tone = tone_detect_multi (ch->ctx, min_tone_hz,
+     max_tone_hz, band_limited);
+    DetectedPitch new_pitch = pitch_identify (ch->ctx, octave_stretch,
+     new_tone.tone_hz);
+
+    if (new_pitch.state == DETECT_UPDATE ||
+     (new_pitch.state == DETECT_NONE && ch->shown_state != DETECT_NONE))
+    {
+        Intervals iv = identify_intervals (octave_stretch, new_pitch.pitch,
+         new_tone.overtones_hz);
+
+        ch->shown_state = new_pitch.state;
+        publish_result (c, & new_tone, & new_pitch, & iv);
+    }
+
+    trace_end (TRACE_ANALYZE, start);
+}
+
+/* The channels are analyzed one after another in the main thread, which is
+ * enough for a few channels at the default settings. */
+
+static void run_analysis (void)
+{
+    if (! io_init (device, & config, n_channels, period_frames, realtime))
+        error_exit ("audio init error");
+
+    trace_set_thread ("dsp");
+
+    JTunerContext * ctx[MAX_CHANNELS];
+
+    for (int c = 0; c < n_channels; c ++)
+    {
+        if (! (ctx[c] = channels[c].ctx = context_new_multi (& config, n_levels)))
+            error_exit ("out of memory");
+    }
+
+    float min_tone_hz = MIN_FREQ_HZ;
+    float max_tone_hz = MAX_FREQ_HZ;
+    bool band_limited = (target_octave > 0);
+
+    if (band_limited)
+    {
+        min_tone_hz = pitch_to_tone_hz (octave_stretch, 12 * target_octave - 6);
+        max_tone_hz = pitch_to_tone_hz (octave_stretch, 12 * target_octave + 6);
+    }
+
+    while (! quit_flag)
+    {
+        if (! io_read_samples (ctx))
+            error_exit ("audio read error");
+
+        for (int c = 0; c < n_channels; c ++)
+            analyze_channel (c, min_tone_hz, max_tone_hz, band_limited);
+    }
+
+    for (int c = 0; c < n_channels; c ++)
+        context_free (ctx[c]);
+
+    io_cleanup ();
+}
+
+int main (int argc, char * * argv)
+{
+    int rate = SAMPLERATE, window_size = N_SAMPLES, hop_size = SAMPLES_PER_STEP;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "c:d:l:m:r:s:t:w:H:IRS:T:")) != -1)
+    {
+        if (opt == 'c')
+            n_channels = atoi (optarg);
+        else if (opt == 'd')
+            device = optarg;
+        else if (opt == 'l')
+            period_frames = atoi (optarg);
+        else if (opt == 'm')
+            n_levels = atoi (optarg);
+        else if (opt == 'r')
+            rate = atoi (optarg);
+        else if (opt == 's')
+            octave_stretch = atof (optarg);
+        else if (opt == 't')
+            target_octave = atof (optarg);
+        else if (opt == 'w')
+            window_size = atoi (optarg);
+        else if (opt == 'H')
+            hop_size = atoi (optarg);
+        else if (opt == 'I')
+            trace_stats = true;
+        else if (opt == 'R')
+            realtime = true;
+        else if (opt == 'S')
+            socket_path = optarg;
+        else if (opt == 'T')
+            trace_name = optarg;
+        else
+            error_exit ("Usage: jtunerd [-c channels] [-d device] [-l period] "
+             "[-m levels] [-r rate] [-s stretch] [-t target octave] "
+             "[-w window] [-H hop] [-R] [-S socket] [-I (stats)] [-T trace.json]");
+    }
+
+    if (n_channels < 1 || n_channels > MAX_CHANNELS)
+        error_exit ("number of channels must be 1 to 8");
+    if (period_frames < 0)
+        error_exit ("period size must not be negative");
+    if (n_levels < 1 || n_levels > MAX_LEVELS)
+        error_exit ("number of window sizes must be 1 to 4");
+    if (target_octave < 0 || target_octave > 8)
+        error_exit ("target octave must be 0 (none) to 8");
+    if (! config_set (& config, rate, window_size, hop_size))
+        error_exit ("invalid sample rate, window size, or hop size");
+
+    static char default_path[256];
+
+    if (! socket_path)
+    {
+        const char * dir = getenv ("XDG_RUNTIME_DIR");
+        snprintf (default_path, sizeof default_path, "%s/jtuner.sock",
+         dir ? dir : "/tmp");
+        socket_path = default_path;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, & start_time);
+
+    open_socket ();
+
+    struct sigaction sa = {.sa_handler = handle_quit};
+    sigaction (SIGINT, & sa, NULL);
+    sigaction (SIGTERM, & sa, NULL);
+    signal (SIGPIPE, SIG_IGN);
+
+    if ((trace_name || trace_stats) && ! trace_init (trace_name, trace_stats))
+        error_exit ("error opening trace file");
+
+    pthread_t server_thread;
+    pthread_create (& server_thread, NULL, server_worker, NULL);
+
+    run_analysis ();
+
+    pthread_join (server_thread, NULL);
+
+    trace_cleanup ();
+
+    close_socket ();
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * JTuner - libjtuner.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Implementation of the public interface (libjtuner.h) on top of the contexts
+ * used internally.  Samples are written straight into the ring buffer of the
+ * context, so the only copying is into the contexts for shorter windows.
+ */
+
+#include "jtuner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_STRETCH 0.05f
+#define DEFAULT_MIN_TONE_HZ 20
+#define DEFAULT_MAX_TONE_HZ 10000
+
+struct JTuner {
+    JTunerContext * ctx;
+
+    float stretch;
+    float min_tone_hz, max_tone_hz;
+    bool band_limited;
+
+    int step_filled;        /* samples written into the next step so far */
+
+    JTunerResult result;
+    bool have_result;
+};
+
+JTuner * jtuner_new (int rate, int window_size, int hop_size, int n_levels)
+{
+    JTunerConfig cfg;
+
+    if (n_levels < 1 || ! config_set (& cfg, rate, window_size, hop_size))
+        return NULL;
+
+    JTuner * jt = calloc (1, sizeof (JTuner));
+    if (! jt)
+        return NULL;
+
+    if (! (jt->ctx = context_new_multi (& cfg, n_levels)))
+    {
+        free (jt);
+        return NULL;
+    }
+
+    jt->stretch = DEFAULT_STRETCH;
+    jt->min_tone_hz = DEFAULT_MIN_TONE_HZ;
+    jt->max_tone_hz = DEFAULT_MAX_TONE_HZ;
+
+    return jt;
+}
+
+void jtuner_free (JTuner * jt)
+{
+    if (! jt)
+        return;
+
+    context_free (jt->ctx);
+    free (jt);
+}
+
+void jtuner_reset (JTuner * jt)
+{
+    context_reset (jt->ctx);
+
+    jt->step_filled = 0;
+    jt->have_result = false;
+    jt->result.step = 0;
+}
+
+int jtuner_hop_size (const JTuner * jt)
+{
+    return jt->ctx->cfg.step_samples;
+}
+
+void jtuner_set_stretch (JTuner * jt, float stretch)
+{
+    jt->stretch = stretch;
+}
+
+void jtuner_set_range (JTuner * jt, float min_tone_hz, float max_tone_hz,
+ bool band_limited)
+{
+    jt->min_tone_hz = min_tone_hz;
+    jt->max_tone_hz = max_tone_hz;
+    jt->band_limited = band_limited;
+}
+
+static void analyze (JTuner * jt)
+{
+    JTunerResult * r = & jt->result;
+
+    if (jt->have_result)
+        r->step ++;
+
+    r->tone = tone_detect_multi (jt->ctx, jt->min_tone_hz, jt->max_tone_hz,
+     jt->band_limited);
+    r->pitch = pitch_identify (jt->ctx, jt->stretch, r->tone.tone_hz);
+    r->intervals = identify_intervals (jt->stretch, r->pitch.pitch,
+     r->tone.overtones_hz);
+
+    jt->have_result = true;
+}
+
+int jtuner_feed (JTuner * jt, const float * samples, int n_samples)
+{
+    int step_samples = jt->ctx->cfg.step_samples;
+    int n_analyzed = 0;
+
+    while (n_samples > 0)
+    {
+        int len = step_samples - jt->step_filled;
+        if (len > n_samples)
+            len = n_samples;
+
+        memcpy (context_next_step (jt->ctx) + jt->step_filled, samples,
+         len * sizeof (float));
+
+        jt->step_filled += len;
+        samples += len;
+        n_samples -= len;
+
+        if (jt->step_filled < step_samples)
+            break;
+
+        jt->step_filled = 0;
+
+        if (context_push_step (jt->ctx))
+        {
+            analyze (jt);
+            n_analyzed ++;
+        }
+    }
+
+    return n_analyzed;
+}
+
+bool jtuner_get_result (const JTuner * jt, JTunerResult * result)
+{
+    if (! jt->have_result)
+        return false;
+
+    * result = jt->result;
+    return true;
+}
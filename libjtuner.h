@@ -0,0 +1,132 @@
+/*
+ * JTuner - libjtuner.h
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Public interface of libjtuner, the analysis engine of JTuner.  An analyzer
+ * is created for each stream of samples, which is fed in blocks of any size.
+ * Each time another hop_size samples have been fed (once the first window has
+ * been filled), the window is analyzed and a new result becomes available.
+ *
+ * Pitches are numbered in semitones from C0 (so that A4 is 57).  Values that
+ * could not be determined are JTUNER_INVALID_VAL.
+ *
+ * An analyzer may be used by only one thread at a time, but any number of
+ * analyzers may be used at once from different threads.
+ */
+
+#ifndef LIBJTUNER_H
+#define LIBJTUNER_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* incremented whenever the interface below changes incompatibly */
+#define JTUNER_API_VERSION 1
+
+#define JTUNER_N_OVERTONES 16
+#define JTUNER_N_INTERVALS 5
+
+#define JTUNER_INVALID_VAL -999
+
+#ifdef JTUNER_BUILD
+#define JTUNER_API __attribute__ ((visibility ("default")))
+#else
+#define JTUNER_API
+#endif
+
+typedef enum {
+    JTUNER_DETECT_NONE,     /* no pitch detected */
+    JTUNER_DETECT_UPDATE,   /* the pitch was detected */
+    JTUNER_DETECT_KEEP      /* the pitch is changing; keep showing the last one */
+} JTunerDetectState;
+
+typedef struct {
+    float tone_hz;
+    float harm_score;
+    float harm_stretch;
+    float overtones_hz[JTUNER_N_OVERTONES];
+} JTunerDetectedTone;
+
+typedef struct {
+    JTunerDetectState state;
+    int pitch;
+    float off_by;           /* in semitones */
+} JTunerDetectedPitch;
+
+typedef struct {
+    int pitch;
+    float off_by;
+} JTunerRoundedPitch;
+
+/* The pitches of the 2nd through 6th harmonics, in order, up to the first
+ * that is not at the expected interval above the fundamental. */
+typedef struct {
+    int n_intervals;
+    JTunerRoundedPitch intervals[JTUNER_N_INTERVALS];
+} JTunerIntervals;
+
+typedef struct {
+    long step;              /* windows analyzed before this one */
+    JTunerDetectedTone tone;
+    JTunerDetectedPitch pitch;
+    JTunerIntervals intervals;
+} JTunerResult;
+
+typedef struct JTuner JTuner;
+
+/* The window and hop sizes are powers of 2 (jtuner uses a 32768-sample window
+ * and a 2048-sample hop at 44100 Hz).  With n_levels > 1, shorter windows are
+ * also used, so that higher pitches are detected sooner.  Returns NULL if the
+ * parameters are not valid or memory could not be allocated. */
+JTUNER_API JTuner * jtuner_new (int rate, int window_size, int hop_size, int n_levels);
+
+/* Does nothing if jt is NULL. */
+JTUNER_API void jtuner_free (JTuner * jt);
+
+/* Forgets all samples fed, as if the analyzer had just been created. */
+JTUNER_API void jtuner_reset (JTuner * jt);
+
+JTUNER_API int jtuner_hop_size (const JTuner * jt);
+
+/* The octave stretch, in semitones, of the tuning to compare against
+ * (0.05 by default). */
+JTUNER_API void jtuner_set_stretch (JTuner * jt, float stretch);
+
+/* The range of fundamental frequencies detected (20 to 10000 Hz by default).
+ * If band_limited is true, only the part of the spectrum within the range is
+ * computed and searched, which is faster when the pitch is roughly known. */
+JTUNER_API void jtuner_set_range (JTuner * jt, float min_tone_hz,
+ float max_tone_hz, bool band_limited);
+
+/* Returns the number of windows analyzed.  Every window is analyzed, but only
+ * the result of the last is kept, so to see every result, feed hop_size
+ * samples at a time. */
+JTUNER_API int jtuner_feed (JTuner * jt, const float * samples, int n_samples);
+
+/* Returns false if no window has been analyzed yet. */
+JTUNER_API bool jtuner_get_result (const JTuner * jt, JTunerResult * result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBJTUNER_H
@@ -49,9 +49,70 @@ static float c4_tone_hz (float s)
     return A4_TONE_HZ / semitones_to_ratio (s, A4_PITCH - C4_PITCH);
 }
 
+/* Rounding a frequency to a pitch is done many times per update (for the
+ * fundamental and each interval), so the frequencies of the pitches from C-2
+ * (about 4 Hz) to C12 (about 67 kHz) and of the boundaries between them are
+ * kept in a table, which is rebuilt only when the stretch changes.  Each
+ * thread has its own table, since different analyzers may use different
+ * stretches. */
+
+#define TABLE_MIN_PITCH -24
+#define TABLE_MAX_PITCH 144
+#define TABLE_SIZE (TABLE_MAX_PITCH - TABLE_MIN_PITCH + 1)
+
+typedef struct {
+    bool valid;
+    float s;
+    float c4_tone_hz;
+    float tone_hz[TABLE_SIZE];
+    float log2_hz[TABLE_SIZE];
+    float log2_bound[TABLE_SIZE + 1];  /* half a semitone below each pitch */
+    float below_scale[TABLE_SIZE];     /* semitones per octave between the */
+    float above_scale[TABLE_SIZE];     /* pitch and the boundaries */
+} PitchTable;
+
+static __thread PitchTable table;
+
+static const PitchTable * get_table (float s)
+{
+    if (table.valid && table.s == s)
+        return & table;
+
+    table.c4_tone_hz = c4_tone_hz (s);
+
+    for (int i = 0; i <= TABLE_SIZE; i ++)
+    {
+        float n = TABLE_MIN_PITCH + i - C4_PITCH;
+
+        if (i < TABLE_SIZE)
+        {
+            table.tone_hz[i] = table.c4_tone_hz * semitones_to_ratio (s, n);
+            table.log2_hz[i] = log2f (table.tone_hz[i]);
+        }
+
+        table.log2_bound[i] = log2f (table.c4_tone_hz * semitones_to_ratio (s, n - 0.5f));
+    }
+
+    for (int i = 0; i < TABLE_SIZE; i ++)
+    {
+        table.below_scale[i] = 0.5f / (table.log2_hz[i] - table.log2_bound[i]);
+        table.above_scale[i] = 0.5f / (table.log2_bound[i + 1] - table.log2_hz[i]);
+    }
+
+    table.s = s;
+    table.valid = true;
+
+    return & table;
+}
+
 float pitch_to_tone_hz (float s, float pitch)
 {
-    return c4_tone_hz (s) * semitones_to_ratio (s, pitch - C4_PITCH);
+    const PitchTable * t = get_table (s);
+
+    if (pitch >= TABLE_MIN_PITCH && pitch <= TABLE_MAX_PITCH && pitch == (int) pitch)
+        return t->tone_hz[(int) pitch - TABLE_MIN_PITCH];
+
+    return t->c4_tone_hz * semitones_to_ratio (s, pitch - C4_PITCH);
 }
 
 float model_harm_stretch (float s, float pitch1, float pitch2)
@@ -72,8 +133,34 @@ RoundedPitch round_to_pitch (float s, float tone_hz)
 
     if (tone_hz > INVALID_VAL)
     {
-        pitch_real = C4_PITCH + ratio_to_semitones (s, tone_hz / c4_tone_hz (s));
-        pitch_rounded = (int) lroundf (pitch_real);
+        const PitchTable * t = get_table (s);
+        float log2_hz = log2f (tone_hz);
+
+        /* outside the table (or not a number) */
+        if (! (log2_hz >= t->log2_bound[0] && log2_hz < t->log2_bound[TABLE_SIZE]))
+        {
+            pitch_real = C4_PITCH + ratio_to_semitones (s, tone_hz / t->c4_tone_hz);
+            pitch_rounded = (int) lroundf (pitch_real);
+        }
+        else
+        {
+            /* start from the nearest pitch without stretch; the stretch moves
+             * the boundaries by at most a few semitones */
+            int i = (int) ((log2_hz - t->log2_bound[0]) * 12);
+            i = (i < 0) ? 0 : (i >= TABLE_SIZE) ? TABLE_SIZE - 1 : i;
+
+            while (log2_hz < t->log2_bound[i])
+                i --;
+            while (log2_hz >= t->log2_bound[i + 1])
+                i ++;
+
+            /* within a semitone, the stretch is close enough to linear */
+            float diff = log2_hz - t->log2_hz[i];
+            float off_by = diff * ((diff < 0) ? t->below_scale[i] : t->above_scale[i]);
+
+            pitch_rounded = TABLE_MIN_PITCH + i;
+            pitch_real = pitch_rounded + off_by;
+        }
     }
 
     return (RoundedPitch) {
@@ -82,29 +169,25 @@ RoundedPitch round_to_pitch (float s, float tone_hz)
     };
 }
 
-DetectedPitch pitch_identify (float s, float tone_hz)
+DetectedPitch pitch_identify (JTunerContext * ctx, float s, float tone_hz)
 {
-    static int last_pitch = INVALID_VAL;
-    static int timein = 0;
-    static int timeout = 0;
-
     RoundedPitch rounded = round_to_pitch (s, tone_hz);
 
-    if (rounded.pitch == last_pitch)
+    if (rounded.pitch == ctx->last_pitch)
     {
-        if (timein)
-            timein --;
+        if (ctx->timein)
+            ctx->timein --;
 
-        if (! timein)
-            timeout = TIMEOUT;
+        if (! ctx->timein)
+            ctx->timeout = TIMEOUT;
     }
     else
     {
-        last_pitch = rounded.pitch;
-        timein = TIMEIN - 1;
+        ctx->last_pitch = rounded.pitch;
+        ctx->timein = TIMEIN - 1;
 
-        if (timeout)
-            timeout --;
+        if (ctx->timeout)
+            ctx->timeout --;
     }
 
     DetectedPitch pitch = {
@@ -113,9 +196,9 @@ DetectedPitch pitch_identify (float s, float tone_hz)
         .off_by = rounded.off_by
     };
 
-    if (timeout)
+    if (ctx->timeout)
     {
-        if (timein)
+        if (ctx->timein)
             pitch.state = DETECT_KEEP;
         else if (rounded.pitch > INVALID_VAL)
             pitch.state = DETECT_UPDATE;
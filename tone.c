@@ -19,9 +19,32 @@
 
 #include "jtuner.h"
 
+#include <float.h>
 #include <math.h>
 
+/* The number of peaks and the harmonic tolerance trade speed for accuracy.
+ * They may be overridden when building jtuner-eval, to measure the effect. */
+#ifndef N_PEAKS
 #define N_PEAKS 32
+#endif
+
+/* overtones are found within this fraction of whole multiples of the tone */
+#ifndef HARM_TOLERANCE
+#define HARM_TOLERANCE 0.05f
+#endif
+
+/* Peaks are located by fitting a parabola to the bin at the peak and those on
+ * each side.  The main lobe of the Hamming window is close to a Gaussian,
+ * which is a parabola in the log domain, so fitting the logs of the powers is
+ * more accurate than fitting the magnitudes (set to 0 to compare). */
+#ifndef LOG_INTERPOLATION
+#define LOG_INTERPOLATION 1
+#endif
+
+/* When the search is limited to a band of frequencies, fewer peaks are taken.
+ * On average, about half of the peaks found in the full spectrum fall within
+ * the band; taking more lets weak noise peaks pass as overtones. */
+#define N_BAND_PEAKS (N_PEAKS / 2)
 #define SQRT_2 1.41421356f
 
 typedef struct {
@@ -29,53 +52,169 @@ typedef struct {
     float level;
 } Peak;
 
-static void find_peaks (const float freqs[N_FREQS], Peak peaks[N_PEAKS])
+/* Compare two bins by level, favoring the lower bin if the levels are equal. */
+
+static bool is_higher (const float freqs[], int i, int j)
+{
+    return freqs[i] > freqs[j] || (freqs[i] == freqs[j] && i < j);
+}
+
+static void sift_down (const float freqs[], int heap[], int n_heap, int i)
 {
-    bool skip[N_FREQS];
+    while (2 * i + 1 < n_heap)
+    {
+        int child = 2 * i + 1;
+
+        if (child + 1 < n_heap && is_higher (freqs, heap[child + 1], heap[child]))
+            child ++;
+
+        if (! is_higher (freqs, heap[child], heap[i]))
+            break;
+
+        int temp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = temp;
+        i = child;
+    }
+}
+
+static bool is_skipped (const int skiplow[], const int skiphigh[], int n_skip, int i)
+{
+    for (int s = 0; s < n_skip; s ++)
+    {
+        if (i >= skiplow[s] && i <= skiphigh[s])
+            return true;
+    }
+
+    return false;
+}
+
+/* The spectrum (freqs) is in power, as computed by fft_run and fft_slide.
+ * Comparisons do not depend on whether power or magnitude is compared, so the
+ * square root is taken only for the peaks found.
+ *
+ * Each peak is the highest bin (from lo to hi) not within 10% of a previous
+ * peak.  The highest bin within a range of bins is either a local maximum or at
+ * one end of the range, so only local maxima (kept in a heap) and bins next to
+ * the skipped ranges need to be considered.  Only the first n_peaks peaks are
+ * found; the rest are set to zero. */
+
+static void find_peaks (const JTunerConfig * cfg, const float freqs[], int lo,
+ int hi, int n_peaks, Peak peaks[N_PEAKS])
+{
+    int heap[cfg->n_freqs / 2 + 2];
+    int n_heap = 0;
+
     int ipeaks[N_PEAKS];
+    int skiplow[N_PEAKS];
+    int skiphigh[N_PEAKS];
 
-    for (int i = 0; i < N_FREQS; i ++)
-        skip[i] = false;
+    /* single pass without branches: the index is always stored, but the count
+     * is only incremented for local maxima */
+    heap[n_heap ++] = lo;
 
-    for (int p = 0; p < N_PEAKS; p ++)
+    for (int i = lo + 1; i < hi; i ++)
     {
-        ipeaks[p] = 1;
-        peaks[p].level = 0;
+        heap[n_heap] = i;
+        n_heap += (freqs[i] > freqs[i - 1]) & (freqs[i] >= freqs[i + 1]);
+    }
+
+    if (hi > lo)
+        heap[n_heap ++] = hi;
+
+    for (int i = n_heap / 2; i --; )
+        sift_down (freqs, heap, n_heap, i);
 
-        for (int i = 1; i < N_FREQS - 1; i ++)
+    for (int p = 0; p < n_peaks; p ++)
+    {
+        while (n_heap && is_skipped (skiplow, skiphigh, p, heap[0]))
         {
-            if (freqs[i] > peaks[p].level && ! skip[i])
+            heap[0] = heap[-- n_heap];
+            sift_down (freqs, heap, n_heap, 0);
+        }
+
+        int best = n_heap ? heap[0] : -1;
+
+        for (int s = 0; s < p; s ++)
+        {
+            int edges[2] = {skiplow[s] - 1, skiphigh[s] + 1};
+
+            for (int e = 0; e < 2; e ++)
             {
-                ipeaks[p] = i;
-                peaks[p].level = freqs[i];
+                int i = edges[e];
+
+                if (i >= lo && i <= hi && (best < 0 || is_higher (freqs, i, best))
+                 && ! is_skipped (skiplow, skiphigh, p, i))
+                    best = i;
             }
         }
 
-        int skiplow = (int) lroundf (ipeaks[p] * 0.9f);
-        int skiphigh = (int) lroundf (ipeaks[p] * 1.1f);
+        if (best >= 0 && freqs[best] > 0)
+        {
+            ipeaks[p] = best;
+            peaks[p].level = sqrtf (freqs[best]);
+        }
+        else
+        {
+            ipeaks[p] = lo;
+            peaks[p].level = 0;
+        }
 
-        if (skiplow < 0)
-            skiplow = 0;
-        if (skiphigh > N_FREQS - 1)
-            skiphigh = N_FREQS - 1;
+        skiplow[p] = (int) lroundf (ipeaks[p] * 0.9f);
+        skiphigh[p] = (int) lroundf (ipeaks[p] * 1.1f);
 
-        for (int i = skiplow; i <= skiphigh; i ++)
-            skip[i] = true;
+        if (skiplow[p] < 0)
+            skiplow[p] = 0;
+        if (skiphigh[p] > cfg->n_freqs - 1)
+            skiphigh[p] = cfg->n_freqs - 1;
     }
 
-    for (int p = 0; p < N_PEAKS; p ++)
+    for (int p = 0; p < n_peaks; p ++)
     {
-        float a = freqs[ipeaks[p] - 1];
-        float b = freqs[ipeaks[p]];
-        float c = freqs[ipeaks[p] + 1];
+#if LOG_INTERPOLATION
+        /* FLT_MIN keeps zero bins out of logf */
+        float a = logf (fmaxf (freqs[ipeaks[p] - 1], FLT_MIN));
+        float b = logf (fmaxf (freqs[ipeaks[p]], FLT_MIN));
+        float c = logf (fmaxf (freqs[ipeaks[p] + 1], FLT_MIN));
+#else
+        float a = sqrtf (freqs[ipeaks[p] - 1]);
+        float b = sqrtf (freqs[ipeaks[p]]);
+        float c = sqrtf (freqs[ipeaks[p] + 1]);
+#endif
 
         float num = a - c;
         float denom = 2 * a - 4 * b + 2 * c;
 
-        peaks[p].freq_hz = (ipeaks[p] + num / denom) * SAMPLERATE / N_SAMPLES;
+        peaks[p].freq_hz = (ipeaks[p] + num / denom) * cfg->rate / cfg->n_samples;
+    }
+
+    for (int p = n_peaks; p < N_PEAKS; p ++)
+    {
+        peaks[p].freq_hz = 0;
+        peaks[p].level = 0;
     }
 }
 
+/* Range of frequency bins needed to detect tones from min_tone_hz to
+ * max_tone_hz, including their overtones and one extra bin on each side for
+ * interpolation. */
+
+void tone_bins (const JTunerConfig * cfg, float min_tone_hz, float max_tone_hz,
+ int * min_bin, int * max_bin)
+{
+    * min_bin = (int) floorf (min_tone_hz * (1 - HARM_TOLERANCE) * cfg->n_samples / cfg->rate) - 1;
+    * max_bin = (int) ceilf (max_tone_hz * N_OVERTONES * (1 + HARM_TOLERANCE) * cfg->n_samples / cfg->rate) + 1;
+
+    if (* min_bin < 0)
+        * min_bin = 0;
+    if (* min_bin > cfg->n_freqs - 3)
+        * min_bin = cfg->n_freqs - 3;
+    if (* max_bin < * min_bin + 2)
+        * max_bin = * min_bin + 2;
+    if (* max_bin > cfg->n_freqs - 1)
+        * max_bin = cfg->n_freqs - 1;
+}
+
 static DetectedTone invalid_tone (void)
 {
     DetectedTone tone;
@@ -102,8 +241,8 @@ static DetectedTone analyze_tone (const Peak peaks[N_PEAKS], float tone_hz)
 
     for (int t = 1; t <= N_OVERTONES; t ++)
     {
-        float min_harm_hz = tone_hz * t * 0.95f;
-        float max_harm_hz = tone_hz * t * 1.05f;
+        float min_harm_hz = tone_hz * t * (1 - HARM_TOLERANCE);
+        float max_harm_hz = tone_hz * t * (1 + HARM_TOLERANCE);
 
         bool found = false;
 
@@ -150,12 +289,30 @@ static bool is_overtone (float tone_hz, float ref_hz)
      || is_same_tone (tone_hz, ref_hz * 5);
 }
 
-static float last_tone_hz = INVALID_VAL;
+/* If band_limited is true, only the frequencies given by tone_bins are
+ * searched, and the others need not have been computed. */
 
-DetectedTone tone_detect (const float freqs[N_FREQS], float min_tone_hz, float max_tone_hz)
+DetectedTone tone_detect (JTunerContext * ctx, const float freqs[],
+ float min_tone_hz, float max_tone_hz, bool band_limited)
 {
     Peak peaks[N_PEAKS];
-    find_peaks (freqs, peaks);
+
+    uint64_t start = trace_start ();
+
+    if (band_limited)
+    {
+        int min_bin, max_bin;
+        tone_bins (& ctx->cfg, min_tone_hz, max_tone_hz, & min_bin, & max_bin);
+
+        /* peaks are interpolated using the bins on each side */
+        find_peaks (& ctx->cfg, freqs, min_bin + 1, max_bin - 1, N_BAND_PEAKS, peaks);
+    }
+    else
+        find_peaks (& ctx->cfg, freqs, 1, ctx->cfg.n_freqs - 2, N_PEAKS, peaks);
+
+    trace_end (TRACE_PEAKS, start);
+
+    start = trace_start ();
 
     DetectedTone best_tone = invalid_tone ();
 
@@ -171,16 +328,119 @@ DetectedTone tone_detect (const float freqs[N_FREQS], float min_tone_hz, float m
          * 1. Favor the same peak found last cycle (reduces "jumpiness")
          * 2. Favor low notes that may be hidden by their own overtones
          */
-        if (last_tone_hz > INVALID_VAL &&
-         (is_same_tone (tone.tone_hz, last_tone_hz) ||
-         (tone.tone_hz < 200 && is_overtone (last_tone_hz, tone.tone_hz))))
+        if (ctx->last_tone_hz > INVALID_VAL &&
+         (is_same_tone (tone.tone_hz, ctx->last_tone_hz) ||
+         (tone.tone_hz < 200 && is_overtone (ctx->last_tone_hz, tone.tone_hz))))
             tone.harm_score *= (tone.tone_hz < 100) ? 4 : 2;
 
         if (tone.harm_score > best_tone.harm_score)
             best_tone = tone;
     }
 
-    last_tone_hz = best_tone.tone_hz;
+    ctx->last_tone_hz = best_tone.tone_hz;
+
+    trace_end (TRACE_TONE, start);
 
     return best_tone;
 }
+
+/* Multi-resolution detection.  A long window is needed to tell apart the
+ * closely spaced overtones of bass notes, but it also keeps the previous note
+ * in view for longer.  So the spectrum is computed for each window size, and
+ * the tone is taken from the shortest window that resolves it, that is, whose
+ * length is at least MIN_PERIODS periods of the tone.  With the default window
+ * sizes, notes from about C5 up are detected with a 4096-sample window, C4 to
+ * C5 with 8192 samples, and so on.  The longest window is used for any tone
+ * not resolved by a shorter one.
+ *
+ * Once a window resolves the tone, the longer windows are searched as well,
+ * and the longest that still finds the same tone gives the frequency, so that
+ * a held note is measured as precisely as with the longest window alone.
+ *
+ * The spectrum of every window is updated at each step, since the sliding DFT
+ * must see every step. */
+
+#define MIN_PERIODS 48
+
+/* A short window may lose a decaying tone in noise before a longer window
+ * does, and then find some other tone.  So if a longer window still finds the
+ * tone reported last, a different tone found by a shorter window is reported
+ * only once it has been found for this many steps in a row. */
+#define SWITCH_STEPS 2
+
+DetectedTone tone_detect_multi (JTunerContext * ctx, float min_tone_hz,
+ float max_tone_hz, bool band_limited)
+{
+    JTunerContext * levels[MAX_LEVELS];
+    int n_levels = 0;
+
+    for (JTunerContext * c = ctx; c && n_levels < MAX_LEVELS; c = c->shorter)
+        levels[n_levels ++] = c;
+
+    /* each window was told the tone reported last (see below) */
+    float last_tone_hz = ctx->last_tone_hz;
+
+    DetectedTone tone = invalid_tone (), longer = invalid_tone ();
+    bool found = false, refine = true;
+
+    /* the shortest window is tried first */
+    for (int l = n_levels; l --; )
+    {
+        JTunerContext * c = levels[l];
+        float freqs[c->cfg.n_freqs];
+
+        int min_bin = 0, max_bin = c->cfg.n_freqs - 1;
+
+        if (band_limited)
+            tone_bins (& c->cfg, min_tone_hz, max_tone_hz, & min_bin, & max_bin);
+
+        uint64_t start = trace_start ();
+        fft_slide (c, freqs, min_bin, max_bin);
+        trace_end (TRACE_SLIDE, start);
+
+        if (found)
+        {
+            if (! refine)
+                continue;
+
+            /* a longer window measures the tone more precisely, so it is used
+             * for as long as it still sees the same tone */
+            longer = tone_detect (c, freqs, min_tone_hz, max_tone_hz, band_limited);
+
+            if (is_same_tone (longer.tone_hz, tone.tone_hz))
+                tone = longer;
+            else
+                refine = false;
+
+            continue;
+        }
+
+        float min_resolved_hz = (float) MIN_PERIODS * c->cfg.rate / c->cfg.n_samples;
+
+        tone = tone_detect (c, freqs, min_tone_hz, max_tone_hz, band_limited);
+        found = (l == 0 || tone.tone_hz >= min_resolved_hz);
+    }
+
+    if (! refine && last_tone_hz > INVALID_VAL && is_same_tone (longer.tone_hz, last_tone_hz))
+    {
+        if (is_same_tone (tone.tone_hz, ctx->new_tone_hz))
+            ctx->new_tone_steps ++;
+        else
+        {
+            ctx->new_tone_hz = tone.tone_hz;
+            ctx->new_tone_steps = 1;
+        }
+
+        if (ctx->new_tone_steps < SWITCH_STEPS)
+            tone = longer;
+    }
+    else
+        ctx->new_tone_steps = 0;
+
+    /* each window favors the tone found last (see tone_detect), which should
+     * be the tone reported, whichever window found it */
+    for (int l = 0; l < n_levels; l ++)
+        levels[l]->last_tone_hz = tone.tone_hz;
+
+    return tone;
+}
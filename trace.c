@@ -0,0 +1,391 @@
+/*
+ * JTuner - trace.c
+ * Copyright 2018 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Timing of each stage of capture, analysis, and display.  Each thread writes
+ * its events into its own ring buffer, which a collector thread drains a few
+ * times per second, adding each event to a histogram for its stage and
+ * writing it to the trace file, if any, in the Chrome trace-event format
+ * (which can be viewed at chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Only the owning thread writes to a ring buffer, and the collector only
+ * reads from it, so no lock is needed.  If the collector falls behind, the
+ * oldest events are overwritten and counted as lost.
+ *
+ * When tracing is not enabled, each stage costs one test of trace_enabled.
+ */
+
+#include "jtuner.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TRACE_THREADS 32
+#define TRACE_RING 8192
+
+#define COLLECT_MS 100
+#define STATS_INTERVAL_MS 5000
+
+/* Histogram buckets: 4 for each power of 2 nanoseconds */
+#define SUB_BUCKETS 4
+#define N_BUCKETS (64 * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t start;         /* nanoseconds */
+    uint32_t duration;
+    uint32_t stage;
+} TraceEvent;
+
+typedef struct {
+    TraceEvent events[TRACE_RING];
+    unsigned head;          /* written only by the owning thread */
+    unsigned tail;          /* used only by the collector */
+    int id;
+    char name[32];
+    bool named;             /* used only by the collector */
+} TraceBuffer;
+
+typedef struct {
+    long count;
+    uint64_t max;
+    long buckets[N_BUCKETS];
+} Histogram;
+
+static const char * const stage_names[N_TRACE_STAGES] = {
+    [TRACE_CAPTURE] = "capture",
+    [TRACE_CONVERT] = "convert",
+    [TRACE_XRUN] = "xrun",
+    [TRACE_DROP] = "drop",
+    [TRACE_QUEUE_WAIT] = "queue_wait",
+    [TRACE_ANALYZE] = "analyze",
+    [TRACE_SLIDE] = "fft_slide",
+    [TRACE_PEAKS] = "find_peaks",
+    [TRACE_TONE] = "tone_detect",
+    [TRACE_BARRIER] = "barrier_wait",
+    [TRACE_SHOW] = "show_results",
+    [TRACE_DRAW] = "draw",
+    [TRACE_PUBLISH] = "publish"
+};
+
+bool trace_enabled;
+
+static TraceBuffer * buffers[MAX_TRACE_THREADS];
+static int n_buffers;
+static __thread TraceBuffer * thread_buffer;
+
+static FILE * trace_file;
+static bool trace_stats;
+static uint64_t trace_origin;
+
+static pthread_t collect_thread;
+static bool collect_stop;
+
+/* used only by the collector */
+static Histogram histograms[N_TRACE_STAGES];
+static long n_lost;
+static bool first_event;
+
+uint64_t trace_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Called by each thread the first time it records an event.  Threads beyond
+ * MAX_TRACE_THREADS are not traced. */
+
+static TraceBuffer * add_buffer (const char * name)
+{
+    int id = __atomic_load_n (& n_buffers, __ATOMIC_ACQUIRE);
+
+    if (id >= MAX_TRACE_THREADS)
+        return NULL;
+
+    TraceBuffer * b = calloc (1, sizeof (TraceBuffer));
+    if (! b)
+        return NULL;
+
+    id = __atomic_fetch_add (& n_buffers, 1, __ATOMIC_ACQ_REL);
+
+    if (id >= MAX_TRACE_THREADS)
+    {
+        free (b);
+        return NULL;
+    }
+
+    b->id = id + 1;
+
+    if (name)
+        snprintf (b->name, sizeof b->name, "%s", name);
+    else
+        snprintf (b->name, sizeof b->name, "thread %d", b->id);
+
+    __atomic_store_n (& buffers[id], b, __ATOMIC_RELEASE);
+    return b;
+}
+
+/* Names the calling thread in the trace.  Must be called before the thread
+ * records any events. */
+
+void trace_set_thread (const char * name)
+{
+    if (trace_enabled && ! thread_buffer)
+        thread_buffer = add_buffer (name);
+}
+
+void trace_event (TraceStage stage, uint64_t start)
+{
+    uint64_t duration = trace_now () - start;
+
+    if (! thread_buffer && ! (thread_buffer = add_buffer (NULL)))
+        return;
+
+    TraceBuffer * b = thread_buffer;
+    unsigned head = b->head;
+
+    b->events[head % TRACE_RING] = (TraceEvent) {
+        .start = start,
+        .duration = (duration < UINT32_MAX) ? duration : UINT32_MAX,
+        .stage = stage
+    };
+
+    __atomic_store_n (& b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int bucket_index (uint64_t ns)
+{
+    if (ns < SUB_BUCKETS)
+        return ns;
+
+    int log2 = 63 - __builtin_clzll (ns);
+    int sub = (ns >> (log2 - 2)) & (SUB_BUCKETS - 1);
+
+    return log2 * SUB_BUCKETS + sub;
+}
+
+/* the lowest value in a bucket */
+static uint64_t bucket_value (int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int log2 = bucket / SUB_BUCKETS;
+    int sub = bucket % SUB_BUCKETS;
+
+    return (uint64_t) (SUB_BUCKETS + sub) << (log2 - 2);
+}
+
+static uint64_t percentile (const Histogram * h, float pct)
+{
+    long rank = (long) (h->count * pct / 100);
+    long seen = 0;
+
+    for (int i = 0; i < N_BUCKETS; i ++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return bucket_value (i);
+    }
+
+    return h->max;
+}
+
+static void write_event (const TraceBuffer * b, const TraceEvent * e)
+{
+    double ts = (double) (int64_t) (e->start - trace_origin) / 1000;
+
+    fprintf (trace_file, first_event ? "\n" : ",\n");
+    first_event = false;
+
+    if (e->stage == TRACE_XRUN || e->stage == TRACE_DROP)
+        fprintf (trace_file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+         "\"ts\":%.3f,\"pid\":1,\"tid\":%d}", stage_names[e->stage], ts, b->id);
+    else
+        fprintf (trace_file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+         "\"dur\":%.3f,\"pid\":1,\"tid\":%d}", stage_names[e->stage], ts,
+         e->duration / 1000.0, b->id);
+}
+
+static void write_thread_name (const TraceBuffer * b)
+{
+    fprintf (trace_file, first_event ? "\n" : ",\n");
+    first_event = false;
+
+    fprintf (trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+     "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", b->id, b->name);
+}
+
+static void collect_buffer (TraceBuffer * b)
+{
+    unsigned head = __atomic_load_n (& b->head, __ATOMIC_ACQUIRE);
+    unsigned tail = b->tail;
+
+    if (head - tail > TRACE_RING)
+    {
+        n_lost += head - tail - TRACE_RING;
+        tail = head - TRACE_RING;
+    }
+
+    for (; tail != head; tail ++)
+    {
+        TraceEvent e = b->events[tail % TRACE_RING];
+
+        /* the event may have been overwritten (or be in the middle of being
+         * overwritten) while it was read */
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n (& b->head, __ATOMIC_RELAXED) - tail >= TRACE_RING)
+        {
+            n_lost ++;
+            continue;
+        }
+
+        Histogram * h = & histograms[e.stage];
+
+        h->count ++;
+        h->buckets[bucket_index (e.duration)] ++;
+
+        if (e.duration > h->max)
+            h->max = e.duration;
+
+        if (trace_file)
+            write_event (b, & e);
+    }
+
+    b->tail = tail;
+}
+
+static void collect (void)
+{
+    int n = __atomic_load_n (& n_buffers, __ATOMIC_ACQUIRE);
+
+    if (n > MAX_TRACE_THREADS)
+        n = MAX_TRACE_THREADS;
+
+    for (int i = 0; i < n; i ++)
+    {
+        /* the count is incremented before the buffer is stored, so a buffer
+         * may not be there yet; it is named the next time around */
+        TraceBuffer * b = __atomic_load_n (& buffers[i], __ATOMIC_ACQUIRE);
+        if (! b)
+            continue;
+
+        if (trace_file && ! b->named)
+        {
+            write_thread_name (b);
+            b->named = true;
+        }
+
+        collect_buffer (b);
+    }
+}
+
+void trace_print_stats (FILE * out)
+{
+    fprintf (out, "%-14s %9s %10s %10s %10s\n", "stage", "count",
+     "p50 us", "p99 us", "max us");
+
+    for (int s = 0; s < N_TRACE_STAGES; s ++)
+    {
+        const Histogram * h = & histograms[s];
+
+        if (! h->count)
+            continue;
+
+        if (s == TRACE_XRUN || s == TRACE_DROP)
+            fprintf (out, "%-14s %9ld\n", stage_names[s], h->count);
+        else
+            fprintf (out, "%-14s %9ld %10.1f %10.1f %10.1f\n", stage_names[s],
+             h->count, percentile (h, 50) / 1000.0, percentile (h, 99) / 1000.0,
+             h->max / 1000.0);
+    }
+
+    if (n_lost)
+        fprintf (out, "%ld events lost\n", n_lost);
+}
+
+static void * collect_worker (void * unused)
+{
+    int since_stats = 0;
+
+    while (! __atomic_load_n (& collect_stop, __ATOMIC_ACQUIRE))
+    {
+        usleep (COLLECT_MS * 1000);
+        collect ();
+
+        if (trace_stats && (since_stats += COLLECT_MS) >= STATS_INTERVAL_MS)
+        {
+            trace_print_stats (stderr);
+            fprintf (stderr, "\n");
+            since_stats = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/* Enables tracing.  If trace_name is given, the events are written there; if
+ * stats is true, percentiles of each stage are printed periodically and at
+ * the end.  Must be called before any other threads are started. */
+
+bool trace_init (const char * trace_name, bool stats)
+{
+    if (trace_name)
+    {
+        if (! (trace_file = fopen (trace_name, "w")))
+            return false;
+
+        fprintf (trace_file, "{\"traceEvents\":[");
+        first_event = true;
+    }
+
+    trace_stats = stats;
+    trace_origin = trace_now ();
+    trace_enabled = true;
+
+    pthread_create (& collect_thread, NULL, collect_worker, NULL);
+
+    return true;
+}
+
+void trace_cleanup (void)
+{
+    if (! trace_enabled)
+        return;
+
+    __atomic_store_n (& collect_stop, true, __ATOMIC_RELEASE);
+    pthread_join (collect_thread, NULL);
+
+    collect ();
+
+    if (trace_file)
+    {
+        fprintf (trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose (trace_file);
+        trace_file = NULL;
+    }
+
+    if (trace_stats)
+        trace_print_stats (stderr);
+}